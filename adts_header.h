@@ -0,0 +1,151 @@
+#ifndef ADTS_HEADER_H
+#define ADTS_HEADER_H
+
+/*
+** ADTS header template for writing raw AAC packets as a .aac stream.
+**
+** adts_header_init() fills the 7 header bytes once per stream from the
+** AudioSpecificConfig in codecpar->extradata (or from the codecpar fields when the
+** stream has no extradata); per packet adts_header_set_length() only patches the
+** 13-bit frame_length.
+**
+** ADTS header, 56 bits
+**  12  syncword ( 0xfff )
+**  1   id ( 0 = MPEG-4 )
+**  2   layer ( 0 )
+**  1   protection_absent ( 1, no CRC )
+**  2   profile ( audio object type - 1 )
+**  4   sampling_frequency_index
+**  1   private_bit
+**  3   channel_configuration
+**  4   originality, home, copyright_id_bit, copyright_id_start
+**  13  frame_length ( header + payload )
+**  11  adts_buffer_fullness ( 0x7ff = variable bitrate )
+**  2   number_of_raw_data_blocks_in_frame - 1
+*/
+
+#include <stdint.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/log.h>
+
+#define ADTS_HEADER_SIZE     7
+#define ADTS_MAX_FRAME_SIZE  0x1fff
+
+static const int adts_sample_rates[13] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+typedef struct ADTSBitReader {
+    const uint8_t *buf;
+    int size_in_bits;
+    int index;
+} ADTSBitReader;
+
+static inline unsigned int adts_read_bits(ADTSBitReader *br, int n)
+{
+    unsigned int val = 0;
+    for (; n > 0; n--, br->index++) {
+        val <<= 1;
+        if (br->index < br->size_in_bits)
+            val |= (br->buf[br->index >> 3] >> (7 - (br->index & 7))) & 1;
+    }
+    return val;
+}
+
+//audioObjectType, 31 escapes to 32 + 6 bits
+static inline int adts_read_object_type(ADTSBitReader *br)
+{
+    int object_type = (int) adts_read_bits(br, 5);
+    return object_type == 31 ? 32 + (int) adts_read_bits(br, 6) : object_type;
+}
+
+//return: sampling_frequency_index of sample_rate, -1 when ADTS can not signal it
+static inline int adts_sample_rate_index(int sample_rate)
+{
+    int i;
+    for (i = 0; i < 13; i++) {
+        if (adts_sample_rates[i] == sample_rate)
+            return i;
+    }
+    return -1;
+}
+
+/*
+** header: ADTS_HEADER_SIZE bytes, frame_length is left 0.
+** return: succeed >= 0 or failed < 0 (not AAC, or a configuration ADTS can not carry)
+*/
+static inline int adts_header_init(uint8_t *header, const AVCodecParameters *par)
+{
+    ADTSBitReader br;
+    int object_type, sample_rate_index, channel_config;
+
+    if (par->codec_id != AV_CODEC_ID_AAC) {
+        av_log(NULL, AV_LOG_ERROR, "ADTS can only carry AAC\n");
+        return AVERROR(EINVAL);
+    }
+
+    if (par->extradata_size >= 2) {
+        //AudioSpecificConfig: audioObjectType 5, samplingFrequencyIndex 4, channelConfiguration 4
+        br.buf          = par->extradata;
+        br.size_in_bits = par->extradata_size * 8;
+        br.index        = 0;
+        object_type       = adts_read_object_type(&br);
+        sample_rate_index = adts_read_bits(&br, 4);
+        if (sample_rate_index == 15)
+            sample_rate_index = adts_sample_rate_index(adts_read_bits(&br, 24));
+        channel_config    = adts_read_bits(&br, 4);
+        //HE-AAC (SBR 5 / PS 29)：ADTS中写核心层的AAC-LC，SBR/PS由解码器隐式识别
+        if (object_type == 5 || object_type == 29) {
+            if (adts_read_bits(&br, 4) == 15)
+                adts_read_bits(&br, 24);
+            object_type = adts_read_object_type(&br);
+        }
+    } else {
+        //没有extradata（例如输入本身是ADTS）时使用demuxer解析出的参数
+        //profile 0..3: Main/LC/SSR/LTP，未知或HE-AAC时写核心层的LC
+        object_type       = par->profile >= 0 && par->profile <= 3 ? par->profile + 1 : 2;
+        sample_rate_index = adts_sample_rate_index(par->sample_rate);
+        channel_config    = 0;
+    }
+
+    //channelConfiguration 0表示声道布局在PCE中，ADTS无法携带，按声道数推出标准布局
+    if (!channel_config) {
+        channel_config = par->ch_layout.nb_channels == 8 ? 7 : par->ch_layout.nb_channels;
+        if (channel_config < 1 || channel_config > 7) {
+            av_log(NULL, AV_LOG_ERROR, "ADTS can not signal %d channels\n", par->ch_layout.nb_channels);
+            return AVERROR(EINVAL);
+        }
+    }
+    if (object_type < 1 || object_type > 4) {
+        av_log(NULL, AV_LOG_ERROR, "ADTS can not signal audio object type %d\n", object_type);
+        return AVERROR(EINVAL);
+    }
+    if (sample_rate_index < 0 || sample_rate_index > 12) {
+        av_log(NULL, AV_LOG_ERROR, "ADTS can not signal sample rate %d\n", par->sample_rate);
+        return AVERROR(EINVAL);
+    }
+
+    header[0] = 0xff;
+    header[1] = 0xf1;
+    header[2] = (object_type - 1) << 6 | sample_rate_index << 2 | channel_config >> 2;
+    header[3] = (channel_config & 0x3) << 6;
+    header[4] = 0;
+    header[5] = 0x1f;
+    header[6] = 0xfc;
+    return 0;
+}
+
+//return: succeed >= 0 or failed < 0 when payload_size does not fit in frame_length
+static inline int adts_header_set_length(uint8_t *header, int payload_size)
+{
+    int length = payload_size + ADTS_HEADER_SIZE;
+
+    if (length > ADTS_MAX_FRAME_SIZE)
+        return AVERROR(EINVAL);
+    header[3] = (header[3] & 0xfc) | length >> 11;
+    header[4] = length >> 3;
+    header[5] = (length & 0x7) << 5 | 0x1f;
+    return 0;
+}
+
+#endif
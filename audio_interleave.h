@@ -0,0 +1,293 @@
+#ifndef AUDIO_INTERLEAVE_H
+#define AUDIO_INTERLEAVE_H
+
+/*
+** Planar -> interleaved PCM conversion shared by the audio decoders.
+**
+** interleave_samples() writes nb_samples samples of every channel plane as
+** c0 c1 ... cN c0 c1 ... cN into dst. Mono is a plain copy, 2/6/8 channels with
+** 2/4/8 byte samples have unrolled kernels, everything else goes through a generic loop.
+** On x86 the stereo and 5.1/7.1 float kernels use SSE2, the stereo ones AVX2 when the
+** cpu supports it (checked at runtime with av_get_cpu_flags).
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <libavutil/cpu.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define INTERLEAVE_HAVE_SSE2 1
+#   include <emmintrin.h>
+#endif
+
+#if defined(INTERLEAVE_HAVE_SSE2) && defined(__GNUC__)
+#   define INTERLEAVE_HAVE_AVX2 1
+#   define INTERLEAVE_TARGET_AVX2 __attribute__((target("avx2")))
+#   include <immintrin.h>
+#elif defined(INTERLEAVE_HAVE_SSE2) && defined(_MSC_VER)
+#   define INTERLEAVE_HAVE_AVX2 1
+#   define INTERLEAVE_TARGET_AVX2
+#   include <immintrin.h>
+#endif
+
+//src points to the channel planes, offset is the first sample to convert in every plane
+typedef void (*InterleaveFunc)(uint8_t *dst, uint8_t * const *src, int offset, int nb_samples);
+
+static inline void interleave_generic(uint8_t *dst, uint8_t * const *src, int offset, int nb_samples,
+                                      int channels, int bytes_per_sample)
+{
+    int i, ch;
+    for (i = offset; i < offset + nb_samples; i++) {
+        for (ch = 0; ch < channels; ch++) {
+            memcpy(dst, src[ch] + bytes_per_sample * i, bytes_per_sample);
+            dst += bytes_per_sample;
+        }
+    }
+}
+
+/*
+** scalar kernels, the channel count and the sample type are compile time constants
+** so the compiler unrolls the channel loop and uses plain loads/stores
+*/
+#define DEFINE_INTERLEAVE_C(channels, type, bits)                                       \
+static void interleave_##channels##ch_##bits##_c(uint8_t *dst, uint8_t * const *src,   \
+                                                 int offset, int nb_samples)           \
+{                                                                                       \
+    type *out = (type *) dst;                                                           \
+    const type *in[channels];                                                           \
+    int i, ch;                                                                          \
+    for (ch = 0; ch < channels; ch++)                                                   \
+        in[ch] = (const type *) src[ch] + offset;                                       \
+    for (i = 0; i < nb_samples; i++)                                                    \
+        for (ch = 0; ch < channels; ch++)                                               \
+            *out++ = in[ch][i];                                                         \
+}
+
+DEFINE_INTERLEAVE_C(2, uint16_t, 16)
+DEFINE_INTERLEAVE_C(2, uint32_t, 32)
+DEFINE_INTERLEAVE_C(2, uint64_t, 64)
+DEFINE_INTERLEAVE_C(6, uint16_t, 16)
+DEFINE_INTERLEAVE_C(6, uint32_t, 32)
+DEFINE_INTERLEAVE_C(6, uint64_t, 64)
+DEFINE_INTERLEAVE_C(8, uint16_t, 16)
+DEFINE_INTERLEAVE_C(8, uint32_t, 32)
+DEFINE_INTERLEAVE_C(8, uint64_t, 64)
+
+#ifdef INTERLEAVE_HAVE_SSE2
+/*
+** SSE2 kernels, each loop iteration converts one vector of samples per channel
+** and hands the tail to the scalar kernel
+*/
+#define DEFINE_INTERLEAVE_2CH_SSE2(bits, unpacklo, unpackhi)                            \
+static void interleave_2ch_##bits##_sse2(uint8_t *dst, uint8_t * const *src,           \
+                                         int offset, int nb_samples)                   \
+{                                                                                       \
+    const int step = 128 / bits;                                                        \
+    const uint8_t *l = src[0] + offset * (bits / 8);                                    \
+    const uint8_t *r = src[1] + offset * (bits / 8);                                    \
+    int i;                                                                              \
+    for (i = 0; i + step <= nb_samples; i += step) {                                    \
+        __m128i a = _mm_loadu_si128((const __m128i *) (l + i * (bits / 8)));            \
+        __m128i b = _mm_loadu_si128((const __m128i *) (r + i * (bits / 8)));            \
+        _mm_storeu_si128((__m128i *) (dst + i * (bits / 4)), unpacklo(a, b));           \
+        _mm_storeu_si128((__m128i *) (dst + i * (bits / 4) + 16), unpackhi(a, b));      \
+    }                                                                                   \
+    if (i < nb_samples)                                                                 \
+        interleave_2ch_##bits##_c(dst + i * (bits / 4), src, offset + i, nb_samples - i); \
+}
+
+DEFINE_INTERLEAVE_2CH_SSE2(16, _mm_unpacklo_epi16, _mm_unpackhi_epi16)
+DEFINE_INTERLEAVE_2CH_SSE2(32, _mm_unpacklo_epi32, _mm_unpackhi_epi32)
+DEFINE_INTERLEAVE_2CH_SSE2(64, _mm_unpacklo_epi64, _mm_unpackhi_epi64)
+
+//transposes 4 vectors of 4 32-bit samples: in[ch] = sample 0..3 -> out[sample] = ch 0..3
+#define TRANSPOSE_4X4_EPI32(c0, c1, c2, c3, s0, s1, s2, s3) do {                        \
+    __m128i t0 = _mm_unpacklo_epi32(c0, c1);                                            \
+    __m128i t1 = _mm_unpacklo_epi32(c2, c3);                                            \
+    __m128i t2 = _mm_unpackhi_epi32(c0, c1);                                            \
+    __m128i t3 = _mm_unpackhi_epi32(c2, c3);                                            \
+    s0 = _mm_unpacklo_epi64(t0, t1);                                                    \
+    s1 = _mm_unpackhi_epi64(t0, t1);                                                    \
+    s2 = _mm_unpacklo_epi64(t2, t3);                                                    \
+    s3 = _mm_unpackhi_epi64(t2, t3);                                                    \
+} while (0)
+
+#define LOAD_PLANE_EPI32(src, ch, i) _mm_loadu_si128((const __m128i *) ((const uint32_t *) (src)[ch] + (i)))
+
+static void interleave_6ch_32_sse2(uint8_t *dst, uint8_t * const *src, int offset, int nb_samples)
+{
+    uint8_t *out = dst;
+    int i;
+    for (i = 0; i + 4 <= nb_samples; i += 4) {
+        __m128i s0, s1, s2, s3, p01, p23;
+        __m128i c4 = LOAD_PLANE_EPI32(src, 4, offset + i);
+        __m128i c5 = LOAD_PLANE_EPI32(src, 5, offset + i);
+        TRANSPOSE_4X4_EPI32(LOAD_PLANE_EPI32(src, 0, offset + i), LOAD_PLANE_EPI32(src, 1, offset + i),
+                            LOAD_PLANE_EPI32(src, 2, offset + i), LOAD_PLANE_EPI32(src, 3, offset + i),
+                            s0, s1, s2, s3);
+        //channels 4 and 5 of samples 0,1 and 2,3
+        p01 = _mm_unpacklo_epi32(c4, c5);
+        p23 = _mm_unpackhi_epi32(c4, c5);
+        _mm_storeu_si128((__m128i *) (out +  0), s0);
+        _mm_storel_epi64((__m128i *) (out + 16), p01);
+        _mm_storeu_si128((__m128i *) (out + 24), s1);
+        _mm_storel_epi64((__m128i *) (out + 40), _mm_unpackhi_epi64(p01, p01));
+        _mm_storeu_si128((__m128i *) (out + 48), s2);
+        _mm_storel_epi64((__m128i *) (out + 64), p23);
+        _mm_storeu_si128((__m128i *) (out + 72), s3);
+        _mm_storel_epi64((__m128i *) (out + 88), _mm_unpackhi_epi64(p23, p23));
+        out += 96;
+    }
+    if (i < nb_samples)
+        interleave_6ch_32_c(out, src, offset + i, nb_samples - i);
+}
+
+static void interleave_8ch_32_sse2(uint8_t *dst, uint8_t * const *src, int offset, int nb_samples)
+{
+    uint8_t *out = dst;
+    int i;
+    for (i = 0; i + 4 <= nb_samples; i += 4) {
+        __m128i a0, a1, a2, a3, b0, b1, b2, b3;
+        TRANSPOSE_4X4_EPI32(LOAD_PLANE_EPI32(src, 0, offset + i), LOAD_PLANE_EPI32(src, 1, offset + i),
+                            LOAD_PLANE_EPI32(src, 2, offset + i), LOAD_PLANE_EPI32(src, 3, offset + i),
+                            a0, a1, a2, a3);
+        TRANSPOSE_4X4_EPI32(LOAD_PLANE_EPI32(src, 4, offset + i), LOAD_PLANE_EPI32(src, 5, offset + i),
+                            LOAD_PLANE_EPI32(src, 6, offset + i), LOAD_PLANE_EPI32(src, 7, offset + i),
+                            b0, b1, b2, b3);
+        _mm_storeu_si128((__m128i *) (out +   0), a0);
+        _mm_storeu_si128((__m128i *) (out +  16), b0);
+        _mm_storeu_si128((__m128i *) (out +  32), a1);
+        _mm_storeu_si128((__m128i *) (out +  48), b1);
+        _mm_storeu_si128((__m128i *) (out +  64), a2);
+        _mm_storeu_si128((__m128i *) (out +  80), b2);
+        _mm_storeu_si128((__m128i *) (out +  96), a3);
+        _mm_storeu_si128((__m128i *) (out + 112), b3);
+        out += 128;
+    }
+    if (i < nb_samples)
+        interleave_8ch_32_c(out, src, offset + i, nb_samples - i);
+}
+#endif
+
+#ifdef INTERLEAVE_HAVE_AVX2
+/*
+** AVX2 stereo kernels. unpack works inside each 128-bit lane, so the two halves
+** are put back in order with a cross-lane permute before storing
+*/
+#define DEFINE_INTERLEAVE_2CH_AVX2(bits, unpacklo, unpackhi)                            \
+static INTERLEAVE_TARGET_AVX2 void interleave_2ch_##bits##_avx2(uint8_t *dst,          \
+        uint8_t * const *src, int offset, int nb_samples)                               \
+{                                                                                       \
+    const int step = 256 / bits;                                                        \
+    const uint8_t *l = src[0] + offset * (bits / 8);                                    \
+    const uint8_t *r = src[1] + offset * (bits / 8);                                    \
+    int i;                                                                              \
+    for (i = 0; i + step <= nb_samples; i += step) {                                    \
+        __m256i a = _mm256_loadu_si256((const __m256i *) (l + i * (bits / 8)));         \
+        __m256i b = _mm256_loadu_si256((const __m256i *) (r + i * (bits / 8)));         \
+        __m256i lo = unpacklo(a, b);                                                    \
+        __m256i hi = unpackhi(a, b);                                                    \
+        _mm256_storeu_si256((__m256i *) (dst + i * (bits / 4)),                         \
+                            _mm256_permute2x128_si256(lo, hi, 0x20));                   \
+        _mm256_storeu_si256((__m256i *) (dst + i * (bits / 4) + 32),                    \
+                            _mm256_permute2x128_si256(lo, hi, 0x31));                   \
+    }                                                                                   \
+    if (i < nb_samples)                                                                 \
+        interleave_2ch_##bits##_sse2(dst + i * (bits / 4), src, offset + i, nb_samples - i); \
+}
+
+DEFINE_INTERLEAVE_2CH_AVX2(16, _mm256_unpacklo_epi16, _mm256_unpackhi_epi16)
+DEFINE_INTERLEAVE_2CH_AVX2(32, _mm256_unpacklo_epi32, _mm256_unpackhi_epi32)
+DEFINE_INTERLEAVE_2CH_AVX2(64, _mm256_unpacklo_epi64, _mm256_unpackhi_epi64)
+#endif
+
+//return: the fastest kernel for the layout on this cpu, NULL if only the generic loop handles it
+static inline InterleaveFunc get_interleave_func(int channels, int bytes_per_sample)
+{
+    int cpu_flags = av_get_cpu_flags();
+    int bits = bytes_per_sample * 8;
+
+    (void) cpu_flags;
+    if (channels == 2) {
+#ifdef INTERLEAVE_HAVE_AVX2
+        if (cpu_flags & AV_CPU_FLAG_AVX2) {
+            if (bits == 16) return interleave_2ch_16_avx2;
+            if (bits == 32) return interleave_2ch_32_avx2;
+            if (bits == 64) return interleave_2ch_64_avx2;
+        }
+#endif
+#ifdef INTERLEAVE_HAVE_SSE2
+        if (bits == 16) return interleave_2ch_16_sse2;
+        if (bits == 32) return interleave_2ch_32_sse2;
+        if (bits == 64) return interleave_2ch_64_sse2;
+#endif
+        if (bits == 16) return interleave_2ch_16_c;
+        if (bits == 32) return interleave_2ch_32_c;
+        if (bits == 64) return interleave_2ch_64_c;
+    } else if (channels == 6) {
+#ifdef INTERLEAVE_HAVE_SSE2
+        if (bits == 32) return interleave_6ch_32_sse2;
+#endif
+        if (bits == 16) return interleave_6ch_16_c;
+        if (bits == 32) return interleave_6ch_32_c;
+        if (bits == 64) return interleave_6ch_64_c;
+    } else if (channels == 8) {
+#ifdef INTERLEAVE_HAVE_SSE2
+        if (bits == 32) return interleave_8ch_32_sse2;
+#endif
+        if (bits == 16) return interleave_8ch_16_c;
+        if (bits == 32) return interleave_8ch_32_c;
+        if (bits == 64) return interleave_8ch_64_c;
+    }
+    return NULL;
+}
+
+/*
+** Interleaves samples [offset, offset + nb_samples) of the planes in src into dst,
+** which must hold nb_samples * channels * bytes_per_sample bytes
+*/
+static inline void interleave_samples(uint8_t *dst, uint8_t * const *src, int offset, int nb_samples,
+                                      int channels, int bytes_per_sample)
+{
+    InterleaveFunc func;
+
+    if (nb_samples <= 0) {
+        return;
+    }
+    if (channels == 1) {
+        memcpy(dst, src[0] + offset * bytes_per_sample, (size_t) nb_samples * bytes_per_sample);
+    } else if ((func = get_interleave_func(channels, bytes_per_sample))) {
+        func(dst, src, offset, nb_samples);
+    } else {
+        interleave_generic(dst, src, offset, nb_samples, channels, bytes_per_sample);
+    }
+}
+
+//return: bytes of one interleaved sample of all channels in frame
+static inline int get_interleaved_sample_size(const AVFrame *frame)
+{
+    return frame->ch_layout.nb_channels * av_get_bytes_per_sample(frame->format);
+}
+
+/*
+** Interleaves samples [offset, offset + nb_samples) of a decoded audio frame into dst.
+** Packed frames are already interleaved and only copied.
+** return: the number of bytes written
+*/
+static inline int interleave_audio_frame(uint8_t *dst, const AVFrame *frame, int offset, int nb_samples)
+{
+    int channels = frame->ch_layout.nb_channels;
+    int bytes_per_sample = av_get_bytes_per_sample(frame->format);
+    int size = nb_samples * channels * bytes_per_sample;
+
+    if (av_sample_fmt_is_planar(frame->format)) {
+        interleave_samples(dst, frame->extended_data, offset, nb_samples, channels, bytes_per_sample);
+    } else if (size > 0) {
+        memcpy(dst, frame->extended_data[0] + offset * channels * bytes_per_sample, size);
+    }
+    return size;
+}
+
+#endif
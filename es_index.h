@@ -0,0 +1,223 @@
+#ifndef ES_INDEX_H
+#define ES_INDEX_H
+
+/*
+** Frame index sidecar for the extracted elementary streams (.h264 / .aac).
+**
+** While a stream is extracted, es_index_add() records one fixed-size entry per
+** written access unit / ADTS frame: where it starts in the output file, how long it
+** is, its type, timestamps and whether decoding can start there. Tools reading the
+** dump load the index with es_index_load() and jump straight to a frame number
+** (O(1)) or to the keyframe before a time (binary search, O(log n)) instead of
+** rescanning the file from the beginning.
+**
+** file layout, all fields little endian:
+**   header  "ESIX", u32 version, i32 time_base.num, i32 time_base.den     16 bytes
+**   entry   u64 offset, i64 pts, i64 dts, u32 size, u8 type, u8 flags,
+**           u16 reserved                                                  32 bytes
+** the number of entries follows from the file size, so an index cut short by a
+** crash is still readable up to the last complete entry.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <libavutil/avutil.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+
+#define ES_INDEX_VERSION     1
+#define ES_INDEX_HEADER_SIZE 16
+#define ES_INDEX_ENTRY_SIZE  32
+
+//decoding can start at this entry (IDR access unit, every AAC frame)
+#define ES_INDEX_FLAG_KEY    0x01
+
+typedef struct ESIndexEntry {
+    int64_t offset;
+    int64_t pts;
+    //decode order timestamp, pts when the stream has no dts
+    int64_t dts;
+    uint32_t size;
+    //first slice NAL type for video (255 when unknown), 0 for audio frames
+    uint8_t type;
+    uint8_t flags;
+} ESIndexEntry;
+
+typedef struct ESIndex {
+    AVRational time_base;
+    ESIndexEntry *entries;
+    int nb_entries;
+    //entry numbers of the keyframes in decode order, searched for time seeks
+    int *keyframes;
+    int nb_keyframes;
+} ESIndex;
+
+/*
+** time_base: of the pts/dts given to es_index_add().
+** return: the index file or NULL on failure
+*/
+static inline FILE *es_index_open(const char *filename, AVRational time_base)
+{
+    uint8_t header[ES_INDEX_HEADER_SIZE];
+    FILE *file;
+
+    if (!(file = fopen(filename, "wb"))) {
+        fprintf(stderr, "Could not open index file '%s'\n", filename);
+        return NULL;
+    }
+    memcpy(header, "ESIX", 4);
+    AV_WL32(header + 4, ES_INDEX_VERSION);
+    AV_WL32(header + 8, time_base.num);
+    AV_WL32(header + 12, time_base.den);
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) {
+        fprintf(stderr, "Could not write index file '%s'\n", filename);
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+//return: succeed >= 0 or failed < 0
+static inline int es_index_add(FILE *file, int64_t offset, uint32_t size, int type, int flags,
+                               int64_t pts, int64_t dts)
+{
+    uint8_t entry[ES_INDEX_ENTRY_SIZE] = { 0 };
+
+    AV_WL64(entry, offset);
+    AV_WL64(entry + 8, pts);
+    AV_WL64(entry + 16, dts != AV_NOPTS_VALUE ? dts : pts);
+    AV_WL32(entry + 24, size);
+    entry[28] = type;
+    entry[29] = flags;
+    return fwrite(entry, 1, sizeof(entry), file) == sizeof(entry) ? 0 : -1;
+}
+
+static inline void es_index_free(ESIndex **pidx)
+{
+    ESIndex *idx = *pidx;
+
+    if (!idx) {
+        return;
+    }
+    av_free(idx->entries);
+    av_free(idx->keyframes);
+    free(idx);
+    *pidx = NULL;
+}
+
+//return: the whole index in memory or NULL when the file is missing or not an index
+static inline ESIndex *es_index_load(const char *filename)
+{
+    uint8_t header[ES_INDEX_HEADER_SIZE];
+    uint8_t *buf = NULL;
+    ESIndex *idx = NULL;
+    FILE *file;
+    long file_size;
+    int i;
+
+    if (!(file = fopen(filename, "rb"))) {
+        fprintf(stderr, "Could not open index file '%s'\n", filename);
+        return NULL;
+    }
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        memcmp(header, "ESIX", 4) || AV_RL32(header + 4) != ES_INDEX_VERSION) {
+        fprintf(stderr, "'%s' is not an index file\n", filename);
+        goto fail;
+    }
+    if (!(idx = (ESIndex *) calloc(1, sizeof(ESIndex)))) {
+        goto fail;
+    }
+    idx->time_base.num = (int32_t) AV_RL32(header + 8);
+    idx->time_base.den = (int32_t) AV_RL32(header + 12);
+    if (idx->time_base.num <= 0 || idx->time_base.den <= 0) {
+        fprintf(stderr, "'%s' has an invalid time base\n", filename);
+        goto fail;
+    }
+
+    fseek(file, 0, SEEK_END);
+    file_size = ftell(file);
+    fseek(file, ES_INDEX_HEADER_SIZE, SEEK_SET);
+    idx->nb_entries = (file_size - ES_INDEX_HEADER_SIZE) / ES_INDEX_ENTRY_SIZE;
+
+    //一次读入所有entry，再解成结构体数组，按帧号查找时直接下标访问
+    if (idx->nb_entries > 0) {
+        if (!(buf = (uint8_t *) av_malloc((size_t) idx->nb_entries * ES_INDEX_ENTRY_SIZE)) ||
+            !(idx->entries = (ESIndexEntry *) av_malloc_array(idx->nb_entries, sizeof(ESIndexEntry))) ||
+            !(idx->keyframes = (int *) av_malloc_array(idx->nb_entries, sizeof(int)))) {
+            goto fail;
+        }
+        if (fread(buf, ES_INDEX_ENTRY_SIZE, idx->nb_entries, file) != (size_t) idx->nb_entries) {
+            fprintf(stderr, "Could not read index file '%s'\n", filename);
+            goto fail;
+        }
+    }
+    for (i = 0; i < idx->nb_entries; i++) {
+        const uint8_t *p = buf + (size_t) i * ES_INDEX_ENTRY_SIZE;
+        ESIndexEntry *e = &idx->entries[i];
+
+        e->offset = (int64_t) AV_RL64(p);
+        e->pts    = (int64_t) AV_RL64(p + 8);
+        e->dts    = (int64_t) AV_RL64(p + 16);
+        e->size   = AV_RL32(p + 24);
+        e->type   = p[28];
+        e->flags  = p[29];
+        if (e->flags & ES_INDEX_FLAG_KEY) {
+            idx->keyframes[idx->nb_keyframes++] = i;
+        }
+    }
+    av_free(buf);
+    fclose(file);
+    return idx;
+
+fail:
+    av_free(buf);
+    es_index_free(&idx);
+    fclose(file);
+    return NULL;
+}
+
+//return: entry of frame number n (decode order, from 0), NULL past the end
+static inline const ESIndexEntry *es_index_get(const ESIndex *idx, int n)
+{
+    return n >= 0 && n < idx->nb_entries ? &idx->entries[n] : NULL;
+}
+
+/*
+** finds where to start reading to present the frame at ts, a presentation time in
+** idx->time_base. Keyframes are compared by pts (dts when they have none).
+** return: entry number of the last keyframe with pts <= ts, the first keyframe when
+** ts is before it, -1 when the index has no keyframe
+*/
+static inline int es_index_search_keyframe(const ESIndex *idx, int64_t ts)
+{
+    int lo = 0, hi = idx->nb_keyframes - 1, mid, found = 0;
+
+    if (!idx->nb_keyframes) {
+        return -1;
+    }
+    //有B帧时dts比pts早，按dts找到的关键帧可能在ts之后才显示。
+    //关键帧（closed GOP的IDR、每个AAC帧）的pts按顺序递增，二分查找最后一个显示时间不晚于ts的关键帧
+    while (lo <= hi) {
+        const ESIndexEntry *e;
+
+        mid = lo + (hi - lo) / 2;
+        e = &idx->entries[idx->keyframes[mid]];
+        if ((e->pts != AV_NOPTS_VALUE ? e->pts : e->dts) <= ts) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return idx->keyframes[found];
+}
+
+//same as es_index_search_keyframe() with the time given in seconds
+static inline int es_index_seek(const ESIndex *idx, double seconds)
+{
+    return es_index_search_keyframe(idx, (int64_t) (seconds * idx->time_base.den / idx->time_base.num));
+}
+
+#endif
@@ -0,0 +1,648 @@
+// ffmpeg_annexb_remux.c
+// 把摄像头导出的H.264裸流（Annex B, 00 00 01分隔）重新封装成MP4，方向与ffmpeg_video.c相反
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/mem.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/timestamp.h>
+#include <libavformat/avformat.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define STARTCODE_HAVE_SSE2 1
+#   include <emmintrin.h>
+#endif
+
+#if defined(STARTCODE_HAVE_SSE2) && defined(__GNUC__)
+#   define STARTCODE_HAVE_AVX2 1
+#   define STARTCODE_TARGET_AVX2 __attribute__((target("avx2")))
+#   include <immintrin.h>
+#elif defined(STARTCODE_HAVE_SSE2) && defined(_MSC_VER)
+#   define STARTCODE_HAVE_AVX2 1
+#   define STARTCODE_TARGET_AVX2
+#   include <immintrin.h>
+#endif
+
+#ifndef AV_WB32
+#   define AV_WB32(p, val) do {                 \
+        uint32_t d = (val);                     \
+        ((uint8_t*)(p))[3] = (d);               \
+        ((uint8_t*)(p))[2] = (d)>>8;            \
+        ((uint8_t*)(p))[1] = (d)>>16;           \
+        ((uint8_t*)(p))[0] = (d)>>24;           \
+    } while(0)
+#endif
+
+//每次从输入文件读取的字节数，跨两次读取的NAL会被移到缓冲区开头
+#define READ_SIZE (4 << 20)
+
+#define NAL_SLICE 1
+#define NAL_IDR   5
+#define NAL_SEI   6
+#define NAL_SPS   7
+#define NAL_PPS   8
+#define NAL_AUD   9
+
+/*
+** Start code scanner.
+** return: the first 00 00 01 in [p, end), end when there is none.
+** NAL数据中的00 00 0x（x <= 3）都被编码器插入了防竞争字节03，所以00 00 01只会出现在NAL之间，
+** 按它切分是安全的；四字节的00 00 00 01多出来的00由调用者当作前一个NAL的尾部零字节去掉
+*/
+typedef const uint8_t *(*FindStartcodeFunc)(const uint8_t *p, const uint8_t *end);
+
+static const uint8_t *find_startcode_c(const uint8_t *p, const uint8_t *end)
+{
+    for (; p + 3 <= end; p++) {
+        //第三个字节大于1时可以直接跳过三个字节
+        if (p[2] > 1)
+            p += 2;
+        else if (!p[0] && !p[1] && p[2] == 1)
+            return p;
+    }
+    return end;
+}
+
+#ifdef STARTCODE_HAVE_SSE2
+//对p、p+1、p+2三次非对齐加载做比较，一次判断16个位置是否为00 00 01
+static const uint8_t *find_startcode_sse2(const uint8_t *p, const uint8_t *end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one  = _mm_set1_epi8(1);
+    int mask;
+
+    for (; p + 18 <= end; p += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i *) p);
+        __m128i b1 = _mm_loadu_si128((const __m128i *) (p + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i *) (p + 2));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero),
+                                                             _mm_cmpeq_epi8(b1, zero)),
+                                               _mm_cmpeq_epi8(b2, one)));
+        if (mask)
+            return p + av_ctz(mask);
+    }
+    return find_startcode_c(p, end);
+}
+#endif
+
+#ifdef STARTCODE_HAVE_AVX2
+static STARTCODE_TARGET_AVX2 const uint8_t *find_startcode_avx2(const uint8_t *p, const uint8_t *end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one  = _mm256_set1_epi8(1);
+    unsigned int mask;
+
+    for (; p + 34 <= end; p += 32) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *) p);
+        __m256i b1 = _mm256_loadu_si256((const __m256i *) (p + 1));
+        __m256i b2 = _mm256_loadu_si256((const __m256i *) (p + 2));
+        mask = (unsigned int) _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero),
+                                                                                      _mm256_cmpeq_epi8(b1, zero)),
+                                                                     _mm256_cmpeq_epi8(b2, one)));
+        if (mask)
+            return p + av_ctz(mask);
+    }
+    return find_startcode_sse2(p, end);
+}
+#endif
+
+static FindStartcodeFunc get_find_startcode_func(void)
+{
+    int cpu_flags = av_get_cpu_flags();
+
+#ifdef STARTCODE_HAVE_AVX2
+    if (cpu_flags & AV_CPU_FLAG_AVX2)
+        return find_startcode_avx2;
+#endif
+#ifdef STARTCODE_HAVE_SSE2
+    if (cpu_flags & AV_CPU_FLAG_SSE2)
+        return find_startcode_sse2;
+#endif
+    (void) cpu_flags;
+    return find_startcode_c;
+}
+
+/*
+** Minimal exp-golomb bit reader for the SPS, reads past the end return 0
+*/
+typedef struct BitReader {
+    const uint8_t *buf;
+    int size_in_bits;
+    int index;
+} BitReader;
+
+static unsigned int read_bit(BitReader *br)
+{
+    unsigned int bit = 0;
+    if (br->index < br->size_in_bits)
+        bit = (br->buf[br->index >> 3] >> (7 - (br->index & 7))) & 1;
+    br->index++;
+    return bit;
+}
+
+static unsigned int read_bits(BitReader *br, int n)
+{
+    unsigned int val = 0;
+    while (n--)
+        val = (val << 1) | read_bit(br);
+    return val;
+}
+
+static unsigned int read_ue(BitReader *br)
+{
+    int leading_zeros = 0;
+    while (!read_bit(br) && leading_zeros < 32)
+        leading_zeros++;
+    if (leading_zeros >= 32)
+        return 0;
+    return (1u << leading_zeros) - 1 + read_bits(br, leading_zeros);
+}
+
+static int read_se(BitReader *br)
+{
+    unsigned int val = read_ue(br);
+    return val & 1 ? (int) ((val + 1) >> 1) : -(int) (val >> 1);
+}
+
+typedef struct SPSInfo {
+    int profile_idc;
+    int chroma_format_idc;
+    int bit_depth_luma_minus8;
+    int bit_depth_chroma_minus8;
+    int width;
+    int height;
+} SPSInfo;
+
+static void skip_scaling_list(BitReader *br, int size)
+{
+    int last_scale = 8, next_scale = 8, i;
+    for (i = 0; i < size && next_scale; i++) {
+        next_scale = (last_scale + read_se(br) + 256) % 256;
+        if (next_scale)
+            last_scale = next_scale;
+    }
+}
+
+/*
+** parses the fields of an SPS NAL unit (with header byte) needed for the MP4 track.
+** return: succeed >= 0 or failed < 0
+*/
+static int parse_sps(const uint8_t *nal, int size, SPSInfo *sps)
+{
+    uint8_t *rbsp;
+    BitReader br;
+    int rbsp_size = 0, zeros = 0, i;
+    int frame_mbs_only, crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    int crop_unit_x, crop_unit_y, mb_width, map_height;
+
+    //去掉防竞争字节（00 00 03中的03），得到RBSP
+    if (!(rbsp = av_malloc(size)))
+        return AVERROR(ENOMEM);
+    for (i = 1; i < size; i++) {
+        if (zeros >= 2 && nal[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = nal[i] ? 0 : zeros + 1;
+        rbsp[rbsp_size++] = nal[i];
+    }
+    br.buf          = rbsp;
+    br.size_in_bits = rbsp_size * 8;
+    br.index        = 0;
+
+    memset(sps, 0, sizeof(*sps));
+    sps->chroma_format_idc = 1;
+    sps->profile_idc = read_bits(&br, 8);
+    read_bits(&br, 16);              //constraint_set flags, level_idc
+    read_ue(&br);                    //seq_parameter_set_id
+    if (sps->profile_idc == 100 || sps->profile_idc == 110 || sps->profile_idc == 122 ||
+        sps->profile_idc == 244 || sps->profile_idc == 44  || sps->profile_idc == 83  ||
+        sps->profile_idc == 86  || sps->profile_idc == 118 || sps->profile_idc == 128 ||
+        sps->profile_idc == 138 || sps->profile_idc == 139 || sps->profile_idc == 134 ||
+        sps->profile_idc == 135) {
+        sps->chroma_format_idc = read_ue(&br);
+        if (sps->chroma_format_idc == 3)
+            read_bit(&br);           //separate_colour_plane_flag
+        sps->bit_depth_luma_minus8   = read_ue(&br);
+        sps->bit_depth_chroma_minus8 = read_ue(&br);
+        read_bit(&br);               //qpprime_y_zero_transform_bypass_flag
+        if (read_bit(&br)) {         //seq_scaling_matrix_present_flag
+            for (i = 0; i < (sps->chroma_format_idc != 3 ? 8 : 12); i++) {
+                if (read_bit(&br))
+                    skip_scaling_list(&br, i < 6 ? 16 : 64);
+            }
+        }
+    }
+    read_ue(&br);                    //log2_max_frame_num_minus4
+    switch (read_ue(&br)) {          //pic_order_cnt_type
+    case 0:
+        read_ue(&br);                //log2_max_pic_order_cnt_lsb_minus4
+        break;
+    case 1:
+        read_bit(&br);               //delta_pic_order_always_zero_flag
+        read_se(&br);                //offset_for_non_ref_pic
+        read_se(&br);                //offset_for_top_to_bottom_field
+        for (i = read_ue(&br); i > 0; i--)
+            read_se(&br);            //offset_for_ref_frame
+        break;
+    }
+    read_ue(&br);                    //max_num_ref_frames
+    read_bit(&br);                   //gaps_in_frame_num_value_allowed_flag
+    mb_width   = read_ue(&br) + 1;
+    map_height = read_ue(&br) + 1;
+    frame_mbs_only = read_bit(&br);
+    if (!frame_mbs_only)
+        read_bit(&br);               //mb_adaptive_frame_field_flag
+    read_bit(&br);                   //direct_8x8_inference_flag
+    if (read_bit(&br)) {             //frame_cropping_flag
+        crop_left   = read_ue(&br);
+        crop_right  = read_ue(&br);
+        crop_top    = read_ue(&br);
+        crop_bottom = read_ue(&br);
+    }
+    av_free(rbsp);
+
+    if (br.index > br.size_in_bits || sps->chroma_format_idc > 3)
+        return AVERROR_INVALIDDATA;
+
+    //裁剪以色度采样为单位，4:2:0水平垂直都是2，场编码时垂直方向再乘2
+    crop_unit_x = sps->chroma_format_idc == 1 || sps->chroma_format_idc == 2 ? 2 : 1;
+    crop_unit_y = (sps->chroma_format_idc == 1 ? 2 : 1) * (2 - frame_mbs_only);
+    sps->width  = mb_width * 16 - (crop_left + crop_right) * crop_unit_x;
+    sps->height = (2 - frame_mbs_only) * map_height * 16 - (crop_top + crop_bottom) * crop_unit_y;
+    if (sps->width <= 0 || sps->height <= 0)
+        return AVERROR_INVALIDDATA;
+    return 0;
+}
+
+/**
+ * AVCC
+ * bits
+ *  8   version ( always 0x01 )
+ *  8   avc profile ( sps[0][1] )
+ *  8   avc compatibility ( sps[0][2] )
+ *  8   avc level ( sps[0][3] )
+ *  6   reserved ( all bits on )
+ *  2   NALULengthSizeMinusOne  // 这里固定写4字节长度
+ *  3   reserved ( all bits on )
+ *  5   number of SPS NALUs (usually 1)
+ *  16  SPS size
+ *  variable SPS NALU data
+ *  8   number of PPS NALUs (usually 1)
+ *  16  PPS size
+ *  variable PPS NALU data
+ *  high profiles: chroma_format, bit depths and the number of SPS extensions follow
+ */
+static int build_avcc_extradata(AVCodecParameters *par, const uint8_t *sps, int sps_size,
+                                const uint8_t *pps, int pps_size, const SPSInfo *info)
+{
+    int high_profile = info->profile_idc == 100 || info->profile_idc == 110 ||
+                       info->profile_idc == 122 || info->profile_idc == 144;
+    int size = 6 + 2 + sps_size + 1 + 2 + pps_size + (high_profile ? 4 : 0);
+    uint8_t *p;
+
+    if (!(par->extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE)))
+        return AVERROR(ENOMEM);
+    par->extradata_size = size;
+
+    p = par->extradata;
+    *p++ = 1;
+    *p++ = sps[1];
+    *p++ = sps[2];
+    *p++ = sps[3];
+    *p++ = 0xff;                     //lengthSizeMinusOne = 3
+    *p++ = 0xe1;                     //1 SPS
+    *p++ = sps_size >> 8;
+    *p++ = sps_size;
+    memcpy(p, sps, sps_size);
+    p += sps_size;
+    *p++ = 1;                        //1 PPS
+    *p++ = pps_size >> 8;
+    *p++ = pps_size;
+    memcpy(p, pps, pps_size);
+    p += pps_size;
+    if (high_profile) {
+        *p++ = 0xfc | info->chroma_format_idc;
+        *p++ = 0xf8 | info->bit_depth_luma_minus8;
+        *p++ = 0xf8 | info->bit_depth_chroma_minus8;
+        *p++ = 0;
+    }
+    return 0;
+}
+
+/*
+** Access unit assembly and muxing.
+** NAL units are appended to the current access unit with 4-byte length prefixes; a new access
+** unit starts at an AUD/SPS/PPS/SEI or at a slice with first_mb_in_slice == 0 once the current
+** one has a slice. The track header is written once the first SPS and PPS have been seen.
+*/
+typedef struct AnnexBRemuxer {
+    AVFormatContext *ofmt_ctx;
+    AVStream *out_stream;
+    AVPacket *pkt;
+    AVRational frame_rate;
+    int header_written;
+
+    //第一个SPS/PPS，用来生成avcC，同样内容的带内参数集不再重复写入packet
+    uint8_t *sps, *pps;
+    int sps_size, pps_size;
+
+    //当前access unit，AVCC格式，发送时整个缓冲区交给packet
+    uint8_t *au;
+    int au_size, au_capacity;
+    int au_has_slice, au_keyframe;
+    int64_t frame_index;
+} AnnexBRemuxer;
+
+static int write_output_header(AnnexBRemuxer *ctx, const char *out_filename)
+{
+    AVCodecParameters *par = ctx->out_stream->codecpar;
+    SPSInfo info;
+    int ret;
+
+    if ((ret = parse_sps(ctx->sps, ctx->sps_size, &info)) < 0) {
+        fprintf(stderr, "Could not parse SPS\n");
+        return ret;
+    }
+    if ((ret = build_avcc_extradata(par, ctx->sps, ctx->sps_size, ctx->pps, ctx->pps_size, &info)) < 0)
+        return ret;
+    par->codec_type = AVMEDIA_TYPE_VIDEO;
+    par->codec_id   = AV_CODEC_ID_H264;
+    par->width      = info.width;
+    par->height     = info.height;
+    ctx->out_stream->time_base      = av_inv_q(ctx->frame_rate);
+    ctx->out_stream->avg_frame_rate = ctx->frame_rate;
+
+    av_dump_format(ctx->ofmt_ctx, 0, out_filename, 1);
+
+    if (!(ctx->ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&ctx->ofmt_ctx->pb, out_filename, AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            fprintf(stderr, "Could not open output file '%s'", out_filename);
+            return ret;
+        }
+    }
+
+    ret = avformat_write_header(ctx->ofmt_ctx, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Error occurred when opening output file\n");
+        return ret;
+    }
+    ctx->header_written = 1;
+    return 0;
+}
+
+//return: succeed >= 0 or failed < 0
+static int flush_access_unit(AnnexBRemuxer *ctx)
+{
+    int ret;
+
+    if (!ctx->au_has_slice) {
+        ctx->au_size = 0;
+        return 0;
+    }
+    //缓冲区连同padding一起交给packet，不再拷贝
+    memset(ctx->au + ctx->au_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    if ((ret = av_packet_from_data(ctx->pkt, ctx->au, ctx->au_size)) < 0)
+        return ret;
+    ctx->au          = NULL;
+    ctx->au_size     = 0;
+    ctx->au_capacity = 0;
+
+    //裸流没有时间戳，按帧率逐帧递增；摄像头码流一般没有B帧，pts和dts相同
+    ctx->pkt->pts = ctx->pkt->dts = ctx->frame_index++;
+    ctx->pkt->duration     = 1;
+    ctx->pkt->stream_index = 0;
+    if (ctx->au_keyframe)
+        ctx->pkt->flags |= AV_PKT_FLAG_KEY;
+    ctx->au_has_slice = 0;
+    ctx->au_keyframe  = 0;
+
+    av_packet_rescale_ts(ctx->pkt, av_inv_q(ctx->frame_rate), ctx->out_stream->time_base);
+    ret = av_interleaved_write_frame(ctx->ofmt_ctx, ctx->pkt);
+    if (ret < 0)
+        fprintf(stderr, "Error muxing packet\n");
+    return ret;
+}
+
+static int append_nal(AnnexBRemuxer *ctx, const uint8_t *nal, int size)
+{
+    int needed = ctx->au_size + 4 + size + AV_INPUT_BUFFER_PADDING_SIZE;
+    int ret;
+
+    if (needed > ctx->au_capacity) {
+        if ((ret = av_reallocp(&ctx->au, FFMAX(needed, 2 * ctx->au_capacity))) < 0)
+            return ret;
+        ctx->au_capacity = FFMAX(needed, 2 * ctx->au_capacity);
+    }
+    AV_WB32(ctx->au + ctx->au_size, size);
+    memcpy(ctx->au + ctx->au_size + 4, nal, size);
+    ctx->au_size += 4 + size;
+    return 0;
+}
+
+static int save_parameter_set(uint8_t **dst, int *dst_size, const uint8_t *nal, int size)
+{
+    if (*dst)
+        return 0;
+    if (!(*dst = av_memdup(nal, size)))
+        return AVERROR(ENOMEM);
+    *dst_size = size;
+    return 0;
+}
+
+//return: succeed >= 0 or failed < 0
+static int handle_nal(AnnexBRemuxer *ctx, const uint8_t *nal, int size, const char *out_filename)
+{
+    int type, ret;
+
+    //去掉四字节startcode或trailing_zero_8bits留下的尾部零字节
+    while (size > 0 && !nal[size - 1])
+        size--;
+    if (size <= 0)
+        return 0;
+    type = nal[0] & 0x1f;
+
+    //一个新的access unit开始了
+    if (ctx->au_has_slice &&
+        (type == NAL_AUD || type == NAL_SEI || type == NAL_SPS || type == NAL_PPS ||
+         (type >= 14 && type <= 18) ||
+         ((type == NAL_SLICE || type == NAL_IDR) && size > 1 && (nal[1] & 0x80)))) {
+        if ((ret = flush_access_unit(ctx)) < 0)
+            return ret;
+    }
+
+    switch (type) {
+    case NAL_AUD:
+        //MP4中不需要AUD
+        return 0;
+    case NAL_SPS:
+        if ((ret = save_parameter_set(&ctx->sps, &ctx->sps_size, nal, size)) < 0)
+            return ret;
+        if (size == ctx->sps_size && !memcmp(nal, ctx->sps, size))
+            return 0;
+        break;
+    case NAL_PPS:
+        if ((ret = save_parameter_set(&ctx->pps, &ctx->pps_size, nal, size)) < 0)
+            return ret;
+        if (size == ctx->pps_size && !memcmp(nal, ctx->pps, size))
+            return 0;
+        break;
+    }
+
+    if (!ctx->header_written) {
+        //第一个SPS和PPS之前的帧无法解码，直接丢弃
+        if (!ctx->sps || !ctx->pps)
+            return 0;
+        if ((ret = write_output_header(ctx, out_filename)) < 0)
+            return ret;
+    }
+
+    if ((ret = append_nal(ctx, nal, size)) < 0)
+        return ret;
+    if (type >= NAL_SLICE && type <= NAL_IDR)
+        ctx->au_has_slice = 1;
+    if (type == NAL_IDR)
+        ctx->au_keyframe = 1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *in_filename, *out_filename;
+    const char *frame_rate_str = "25";
+    AnnexBRemuxer ctx = { 0 };
+    FindStartcodeFunc find_startcode = get_find_startcode_func();
+    FILE *in_file = NULL;
+    uint8_t *buf = NULL, *tmp;
+    size_t buf_len = 0, buf_capacity = 0, read_len;
+    size_t scan_pos = 0, nal_start = 0, keep;
+    int have_nal = 0;
+    const uint8_t *sc;
+    int ret = 0, i;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-framerate")) {
+            frame_rate_str = argv[i + 1];
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (argc - i < 2) {
+        printf("usage: %s [-framerate rate] input.h264 output.mp4\n"
+               "Repackage a raw H.264 Annex B bytestream into a container without decoding.\n"
+               "The raw stream has no timestamps, frames are timed with -framerate (default 25).\n"
+               "\n", argv[0]);
+        return 1;
+    }
+    in_filename  = argv[i];
+    out_filename = argv[i + 1];
+
+    if (av_parse_video_rate(&ctx.frame_rate, frame_rate_str) < 0) {
+        fprintf(stderr, "Invalid frame rate '%s'\n", frame_rate_str);
+        return 1;
+    }
+
+    if (!(in_file = fopen(in_filename, "rb"))) {
+        fprintf(stderr, "Could not open input file '%s'\n", in_filename);
+        return 1;
+    }
+
+    ctx.pkt = av_packet_alloc();
+    if (!ctx.pkt) {
+        fprintf(stderr, "Could not allocate AVPacket\n");
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    //获取输出文件流的上下文结构体，码流参数在第一个SPS/PPS到达后再填写
+    avformat_alloc_output_context2(&ctx.ofmt_ctx, NULL, NULL, out_filename);
+    if (!ctx.ofmt_ctx) {
+        fprintf(stderr, "Could not create output context\n");
+        ret = AVERROR_UNKNOWN;
+        goto end;
+    }
+    ctx.out_stream = avformat_new_stream(ctx.ofmt_ctx, NULL);
+    if (!ctx.out_stream) {
+        fprintf(stderr, "Failed allocating output stream\n");
+        ret = AVERROR_UNKNOWN;
+        goto end;
+    }
+
+    for (;;) {
+        if (buf_capacity - buf_len < READ_SIZE) {
+            //一个NAL比缓冲区还大时才会走到这里扩大缓冲区
+            if (!(tmp = av_realloc(buf, buf_len + READ_SIZE))) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            buf = tmp;
+            buf_capacity = buf_len + READ_SIZE;
+        }
+        read_len = fread(buf + buf_len, 1, READ_SIZE, in_file);
+        buf_len += read_len;
+        if (!read_len)
+            break;
+
+        //每个startcode结束前一个NAL，最后一个NAL要等下一个startcode或文件结束
+        while ((sc = find_startcode(buf + scan_pos, buf + buf_len)) < buf + buf_len) {
+            if (have_nal && (ret = handle_nal(&ctx, buf + nal_start, sc - buf - nal_start, out_filename)) < 0)
+                goto end;
+            nal_start = scan_pos = sc - buf + 3;
+            have_nal = 1;
+        }
+        //startcode可能跨两次读取，最后两个字节下次重新扫描
+        scan_pos = buf_len >= 2 ? buf_len - 2 : 0;
+        if (have_nal && scan_pos < nal_start)
+            scan_pos = nal_start;
+
+        //只保留还没结束的NAL
+        keep = have_nal ? nal_start : scan_pos;
+        memmove(buf, buf + keep, buf_len - keep);
+        buf_len   -= keep;
+        scan_pos  -= keep;
+        nal_start -= have_nal ? keep : 0;
+    }
+    if (ferror(in_file)) {
+        fprintf(stderr, "Error reading '%s'\n", in_filename);
+        ret = AVERROR(EIO);
+        goto end;
+    }
+
+    if (have_nal && (ret = handle_nal(&ctx, buf + nal_start, buf_len - nal_start, out_filename)) < 0)
+        goto end;
+    if (!ctx.header_written) {
+        fprintf(stderr, "No SPS/PPS found in '%s'\n", in_filename);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    if ((ret = flush_access_unit(&ctx)) < 0)
+        goto end;
+    printf("%"PRId64" frames written\n", ctx.frame_index);
+
+    av_write_trailer(ctx.ofmt_ctx);
+end:
+    av_packet_free(&ctx.pkt);
+    if (in_file)
+        fclose(in_file);
+
+    /* close output */
+    if (ctx.ofmt_ctx && !(ctx.ofmt_ctx->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&ctx.ofmt_ctx->pb);
+    avformat_free_context(ctx.ofmt_ctx);
+
+    av_free(buf);
+    av_free(ctx.au);
+    av_free(ctx.sps);
+    av_free(ctx.pps);
+
+    if (ret < 0 && ret != AVERROR_EOF) {
+        fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
+        return 1;
+    }
+
+    return 0;
+}
@@ -7,6 +7,9 @@
  
 #include <libavcodec/avcodec.h>
 
+#include "audio_interleave.h"
+#include "output_sink.h"
+
 #define AUDIO_INBUF_SIZE 20480
 #define AUDIO_REFILL_THRESH 4096
 
@@ -39,9 +42,9 @@ static int get_format_from_sample_fmt(const char **fmt,
     return -1;
 }
 
-void decode(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame* frame, FILE* out_file) {
-	int i, ch;
+void decode(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame* frame, OutputSink* sink) {
 	int ret, data_size;
+	uint8_t *dst;
 
 	ret = avcodec_send_packet(codec_ctx, pkt);
 	if (ret < 0) {
@@ -64,9 +67,12 @@ void decode(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame* frame, FILE* out_
             fprintf(stderr, "Failed to calculate data size\n");
             exit(1);
         }
-        for (i = 0; i < frame->nb_samples; i++)
-			for (ch = 0; ch < codec_ctx->ch_layout.nb_channels; ch++)
-                fwrite(frame->data[ch] + data_size*i, 1, data_size, out_file);
+        //整帧直接交错写入输出缓冲区，攒够整块后才真正写文件
+        if (!(dst = output_sink_reserve(sink, (size_t) frame->nb_samples * get_interleaved_sample_size(frame)))) {
+            fprintf(stderr, "failed to alloc audio output buffer\n");
+            exit(1);
+        }
+        output_sink_commit(sink, interleave_audio_frame(dst, frame, 0, frame->nb_samples));
 	}
 }
 
@@ -78,6 +84,7 @@ int main(int argc, char* argv[]) {
 	AVPacket* pkt = NULL;
 	AVCodecParserContext* parser = NULL;
 	FILE* in_file, * out_file;
+	OutputSink* sink;
 	int ret, len, n_channels;
 	uint8_t buf[AUDIO_INBUF_SIZE + AUDIO_REFILL_THRESH];
 	uint8_t* data;
@@ -86,7 +93,7 @@ int main(int argc, char* argv[]) {
 	const char *fmt;
 
 	if (argc < 3) {
-		fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
+		fprintf(stderr, "Usage: %s <input file> <output file> [-async_write]\n", argv[0]);
         exit(1);
 	}
 
@@ -142,6 +149,13 @@ int main(int argc, char* argv[]) {
         exit(1);
 	}
 
+	//输出经过缓冲区按整块写入，-async_write时由单独的线程写文件
+	sink = output_sink_open(out_file, argc > 3 && !strcmp(argv[3], "-async_write"));
+	if (!sink) {
+		fprintf(stderr, "failed to alloc output sink\n");
+		exit(1);
+	}
+
 	//开辟的缓存空间
 	data = buf;
 	//从输入文件中读取20480字节的数据
@@ -172,7 +186,7 @@ int main(int argc, char* argv[]) {
 
 		//如果解析后构建packet有数据，则针对packet解码
 		if (pkt->size) {
-			decode(codec_ctx, pkt, frame, out_file);
+			decode(codec_ctx, pkt, frame, sink);
 		}
 
 		//如果剩余的缓存空间大小小于预制的刷新的大小，则刷新缓存区
@@ -189,7 +203,7 @@ int main(int argc, char* argv[]) {
 
 	pkt->data = NULL;
 	pkt->size = 0;
-	decode(codec_ctx, pkt, frame, out_file);
+	decode(codec_ctx, pkt, frame, sink);
 
     sfmt = codec_ctx->sample_fmt;
  
@@ -211,6 +225,8 @@ int main(int argc, char* argv[]) {
            out_filename);
 
 end:
+    if (output_sink_close(&sink) < 0)
+        fprintf(stderr, "failed to write output file\n");
     fclose(out_file);
     fclose(in_file);
 
@@ -1,11 +1,27 @@
+//rawvideo输出按帧号定位写入，文件会超过2GB
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <libavformat/avformat.h>
 #include <libavcodec/packet.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/cpu.h>
+#include "audio_interleave.h"
+#include "output_sink.h"
+
+//-parallel和-gop_parallel需要POSIX线程和ftruncate，没有时只能串行解码
+#if !defined(_WIN32)
+#   define HAVE_PTHREADS 1
+#   include <unistd.h>
+#   include <pthread.h>
+#endif
 
 #define STREAM_BUFFER_SIZE 20480
 #define STREAM_REFRESH_SIZE 4096
+#define PACKET_QUEUE_SIZE 128
 
 static int video_frame_count;
 static uint8_t *video_dst_data[4] = {NULL};
@@ -13,6 +29,11 @@ static int video_dst_linesize[4];
 static int video_dst_bufsize;
 static int width, height;
 static enum AVPixelFormat pix_fmt;
+//-frame_files: every video frame goes to its own file <prefix>-<n> instead of one rawvideo file
+static const char *frame_files_prefix;
+//-ss/-to in AV_TIME_BASE units, AV_NOPTS_VALUE when not set
+static int64_t range_start = AV_NOPTS_VALUE;
+static int64_t range_end = AV_NOPTS_VALUE;
 
 typedef struct Audio_Parameters {
     int channels;
@@ -25,6 +46,70 @@ typedef struct Video_Parameters {
     double frame_rate;
 } Video_Para;
 
+/*
+** rawvideo output split into segments of constant geometry.
+** segment 0 is written to filename, segment n to filename.n, every segment gets a
+** sidecar <segment>.txt with its width, height, pixel format and frame count
+*/
+typedef struct VideoOutput {
+    const char *filename;
+    double frame_rate;
+    FILE *file;
+    int segment;
+    int segment_frames;
+    //video_frame_count when the segment started, the -frame_files number of its first frame
+    int first_frame;
+    int opened;
+} VideoOutput;
+
+/*
+** Decoder threading selected by init_codec_context.
+** CODEC_THREAD_AUTO picks frame threading when the decoder supports it (falling back to
+** slice threading) for video, and a single thread for audio where threading does not pay off.
+*/
+enum CodecThreadMode {
+    CODEC_THREAD_AUTO,
+    CODEC_THREAD_FRAME,
+    CODEC_THREAD_SLICE,
+};
+
+typedef struct CodecOptions {
+    enum CodecThreadMode thread_mode;
+    //0 means one thread per core
+    int thread_count;
+} CodecOptions;
+
+#ifdef HAVE_PTHREADS
+/*
+** Bounded packet queue between the demux loop and a decode worker (-parallel).
+** put blocks while the queue is full, get blocks while it is empty and fails
+** once the queue is drained after packet_queue_finish.
+*/
+typedef struct PacketQueue {
+    AVPacket **pkt_array;
+    int capacity;
+    int head_index;
+    int count;
+    int finished;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} PacketQueue;
+
+//one decode thread per stream, each one owns its codec context and output
+typedef struct DecodeWorker {
+    AVCodecContext *codec_ctx;
+    PacketQueue queue;
+    OutputSink *audio_sink;
+    VideoOutput *video_out;
+    //-keyframes: non-key packets are dropped before they reach the queue
+    int keyframes_only;
+    //-to: the demuxer reached the end of the range in this stream
+    int range_done;
+    pthread_t thread;
+} DecodeWorker;
+#endif
+
 static int get_format_from_sample_fmt(const char **fmt,
                                       enum AVSampleFormat sample_fmt)
 {
@@ -54,9 +139,48 @@ static int get_format_from_sample_fmt(const char **fmt,
     return -1;
 }
 
-void decode_audio(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame* frame, FILE* out_file) {
-	int i, ch;
-	int ret, data_size;
+//return: 1 when the frame is outside the -ss/-to range, frames without pts are kept
+static int frame_outside_range(const AVFrame *frame, AVRational time_base) {
+    int64_t ts = frame->best_effort_timestamp;
+    if (ts == AV_NOPTS_VALUE) {
+        return 0;
+    }
+    ts = av_rescale_q(ts, time_base, AV_TIME_BASE_Q);
+    return (range_start != AV_NOPTS_VALUE && ts < range_start) ||
+           (range_end != AV_NOPTS_VALUE && ts >= range_end);
+}
+
+/*
+** the samples of an audio frame inside the -ss/-to range, cut to the sample.
+** return: the number of samples to keep starting at *offset
+*/
+static int get_audio_range(const AVFrame *frame, AVRational time_base, int *offset) {
+    int64_t ts = frame->best_effort_timestamp;
+    int start = 0, end = frame->nb_samples;
+
+    if (ts != AV_NOPTS_VALUE) {
+        ts = av_rescale_q(ts, time_base, AV_TIME_BASE_Q);
+        if (range_start != AV_NOPTS_VALUE && ts < range_start) {
+            start = (int) FFMIN(av_rescale(range_start - ts, frame->sample_rate, AV_TIME_BASE), end);
+        }
+        if (range_end != AV_NOPTS_VALUE) {
+            end = (int) FFMAX(FFMIN(av_rescale(range_end - ts, frame->sample_rate, AV_TIME_BASE), end), start);
+        }
+    }
+    *offset = start;
+    return end - start;
+}
+
+//return: 1 when pkt and every later packet of its stream are past the -to range (dts never goes back)
+static int packet_past_range_end(const AVFormatContext *fmt_ctx, const AVPacket *pkt) {
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    return range_end != AV_NOPTS_VALUE && ts != AV_NOPTS_VALUE &&
+           av_compare_ts(ts, fmt_ctx->streams[pkt->stream_index]->time_base, range_end, AV_TIME_BASE_Q) >= 0;
+}
+
+void decode_audio(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame* frame, OutputSink* sink) {
+	int ret, data_size, offset, nb_samples;
+    uint8_t *dst;
 
 	ret = avcodec_send_packet(codec_ctx, pkt);
 	if (ret < 0) {
@@ -80,15 +204,105 @@ void decode_audio(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame* frame, FILE
             exit(1);
         }
         
-        for (i = 0; i < frame->nb_samples; i++)
-			for (ch = 0; ch < codec_ctx->ch_layout.nb_channels; ch++) {
-                fwrite(frame->data[ch] + data_size*i, 1, data_size, out_file);
-            }
+        //-ss/-to范围外的样本不输出，范围边界精确到样本
+        if (!(nb_samples = get_audio_range(frame, codec_ctx->pkt_timebase, &offset))) {
+            continue;
+        }
+        //整帧直接交错写入输出缓冲区，攒够整块后才真正写文件
+        if (!(dst = output_sink_reserve(sink, (size_t) nb_samples * get_interleaved_sample_size(frame)))) {
+            fprintf(stderr, "Failed to alloc audio output buffer\n");
+            exit(1);
+        }
+        output_sink_commit(sink, interleave_audio_frame(dst, frame, offset, nb_samples));
 	}
 }
 
-static void decode_video(AVCodecContext *dec_ctx, AVPacket *pkt, AVFrame *frame, FILE *out_file)
+static void get_segment_filename(const VideoOutput *out, char *buf, size_t size) {
+    if (out->segment) {
+        snprintf(buf, size, "%s.%d", out->filename, out->segment);
+    } else {
+        snprintf(buf, size, "%s", out->filename);
+    }
+}
+
+//return: succeed >= 0 or failed < 0. -frame_files segments have no file of their own
+static int open_video_segment(VideoOutput *out) {
+    char filename[1024];
+
+    get_segment_filename(out, filename, sizeof(filename));
+    if (!frame_files_prefix && !(out->file = fopen(filename, "wb"))) {
+        fprintf(stderr, "Failed to open video output file %s\n", filename);
+        return -1;
+    }
+    out->segment_frames = 0;
+    out->first_frame = video_frame_count;
+    out->opened = 1;
+    return 0;
+}
+
+//closes the segment file and writes its sidecar with the current geometry
+static void close_video_segment(VideoOutput *out) {
+    char filename[1024], sidecar_filename[1040];
+    FILE *sidecar;
+
+    if (!out->opened) {
+        return;
+    }
+    out->opened = 0;
+    if (out->file) {
+        fclose(out->file);
+        out->file = NULL;
+    }
+
+    get_segment_filename(out, filename, sizeof(filename));
+    snprintf(sidecar_filename, sizeof(sidecar_filename), "%s.txt", filename);
+    if (!(sidecar = fopen(sidecar_filename, "w"))) {
+        fprintf(stderr, "Failed to open video segment sidecar %s\n", sidecar_filename);
+        return;
+    }
+    fprintf(sidecar, "width=%d\nheight=%d\npix_fmt=%s\nframe_rate=%.3f\nframes=%d\nfirst_frame=%d\n",
+            width, height, av_get_pix_fmt_name(pix_fmt), out->frame_rate, out->segment_frames, out->first_frame);
+    fclose(sidecar);
+
+    printf("Play the output video file with the command:\n"
+            "ffplay -f rawvideo -pixel_format %s -framerate %.0f -video_size %dx%d %s%s\n",
+            av_get_pix_fmt_name(pix_fmt), out->frame_rate, width, height,
+            filename, frame_files_prefix ? "-<n>" : "");
+}
+
+/*
+** the geometry of the decoded frames changed: finishes the current segment,
+** reallocates video_dst_data for frame and starts the next segment. A segment
+** without frames yet is kept open and only takes the new geometry.
+** return: succeed >= 0 or failed < 0
+*/
+static int start_video_segment(VideoOutput *out, const AVFrame *frame) {
+    int ret, reuse = out->opened && !out->segment_frames;
+
+    if (!reuse) {
+        close_video_segment(out);
+    }
+    av_freep(&video_dst_data[0]);
+    width = frame->width;
+    height = frame->height;
+    pix_fmt = frame->format;
+    if ((ret = av_image_alloc(video_dst_data, video_dst_linesize, width, height, pix_fmt, 1)) < 0) {
+        fprintf(stderr, "Failed to alloc raw video buffer\n");
+        return ret;
+    }
+    video_dst_bufsize = ret;
+    //空的分段直接沿用，不留下frames=0的sidecar，分段编号也不跳号
+    if (reuse) {
+        return 0;
+    }
+    out->segment++;
+    return open_video_segment(out);
+}
+
+static void decode_video(AVCodecContext *dec_ctx, AVPacket *pkt, AVFrame *frame, VideoOutput *out)
 {
+    char frame_filename[1024];
+    FILE *out_file = out->file;
     int ret;
  
     ret = avcodec_send_packet(dec_ctx, pkt);
@@ -105,6 +319,9 @@ static void decode_video(AVCodecContext *dec_ctx, AVPacket *pkt, AVFrame *frame,
             fprintf(stderr, "Error during decoding\n");
             exit(1);
         }
+        //seek后到-ss之间的帧只解码不输出
+        if (frame_outside_range(frame, dec_ctx->pkt_timebase))
+            continue;
  
         printf("saving frame %3"PRId64"\n", dec_ctx->frame_num);
         fflush(stdout);
@@ -114,94 +331,263 @@ static void decode_video(AVCodecContext *dec_ctx, AVPacket *pkt, AVFrame *frame,
         //snprintf(buf, sizeof(buf), "%s-%"PRId64, filename, dec_ctx->frame_num);
         if (frame->width != width || frame->height != height ||
                 frame->format != pix_fmt) {
-            /* To handle this change, one could call av_image_alloc again and
-            * decode the following frames into another rawvideo file. */
-            fprintf(stderr, "Error: Width, height and pixel format have to be "
-                    "constant in a rawvideo file, but the width, height or "
-                    "pixel format of the input video changed:\n"
+            /* width, height and pixel format have to be constant in a rawvideo file,
+            * the following frames go to the next segment file */
+            fprintf(stderr, "The width, height or pixel format of the input video changed, "
+                    "starting segment %d:\n"
                     "old: width = %d, height = %d, format = %s\n"
                     "new: width = %d, height = %d, format = %s\n",
+                    out->segment_frames ? out->segment + 1 : out->segment,
                     width, height, av_get_pix_fmt_name(pix_fmt),
                     frame->width, frame->height,
                     av_get_pix_fmt_name(frame->format));
-            return;
+            if (start_video_segment(out, frame) < 0) {
+                exit(1);
+            }
+            out_file = out->file;
         }
     
-        printf("video_frame n:%d\n", video_frame_count++);
+        printf("video_frame n:%d\n", video_frame_count);
     
         /* copy decoded frame to destination buffer:
         * this is required since rawvideo expects non aligned data */
         av_image_copy(video_dst_data, video_dst_linesize,
                     (const uint8_t **)(frame->data), frame->linesize,
                     pix_fmt, width, height);
+        if (frame_files_prefix) {
+            snprintf(frame_filename, sizeof(frame_filename), "%s-%d", frame_files_prefix, video_frame_count);
+            if (!(out_file = fopen(frame_filename, "wb"))) {
+                fprintf(stderr, "Failed to open video frame file %s\n", frame_filename);
+                exit(1);
+            }
+        }
+        video_frame_count++;
+        out->segment_frames++;
         /* write to rawvideo file */
         //fwrite时只需要video_dst_data[0]是因为，video_dst_data是一个指针数组，
         //在读取完video_dst_data[0]后会继续读取video_dst_data[1] video_dst_data[2] video_dst_data[3]
         fwrite(video_dst_data[0], 1, video_dst_bufsize, out_file);
+        if (frame_files_prefix) {
+            fclose(out_file);
+        }
     }
 }
 
-void get_adts_header(char* adts_header_buf, const int frame_size) {
-    //parse audio parameters
-    //int sample_rate = codec_ctx->sample_rate;
-    //int channels = codec_ctx->ch_layout.nb_channels;
+#ifdef HAVE_PTHREADS
+//return: succeed >= 0 or failed < 0
+static int packet_queue_init(PacketQueue *q, int capacity) {
+    int i;
+    memset(q, 0, sizeof(PacketQueue));
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    if (!(q->pkt_array = (AVPacket **) av_calloc(capacity, sizeof(AVPacket *)))) {
+        return -1;
+    }
+    q->capacity = capacity;
+    for (i = 0; i < capacity; i++) {
+        if (!(q->pkt_array[i] = av_packet_alloc())) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    //synword 12bits
-    adts_header_buf[0] = 0xff;
-    adts_header_buf[1] = 0xf << 4;
+static void packet_queue_destroy(PacketQueue *q) {
+    int i;
+    if (q->pkt_array) {
+        for (i = 0; i < q->capacity; i++) {
+            av_packet_free(&q->pkt_array[i]);
+        }
+        av_freep(&q->pkt_array);
+    }
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->mutex);
+}
 
-    //id 1bit
-    adts_header_buf[1] = adts_header_buf[1] | 0 << 3;
+//takes the reference of pkt, pkt is blank afterwards
+static void packet_queue_put(PacketQueue *q, AVPacket *pkt) {
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == q->capacity) {
+        pthread_cond_wait(&q->not_full, &q->mutex);
+    }
+    av_packet_move_ref(q->pkt_array[(q->head_index + q->count) % q->capacity], pkt);
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
 
-    //layer 2bits
-    //adts_header_buf[1] = adts_header_buf[1] | 0 << 2;
-    
-    //protection_absent 1bit
-    adts_header_buf[1] = adts_header_buf[1] | 1;
-    
-    //pro 2bits
-    adts_header_buf[2] = 1 << 6;
+//return: succeed >= 0 or failed < 0 (the queue is finished and empty)
+static int packet_queue_get(PacketQueue *q, AVPacket *pkt) {
+    int ret = -1;
+    pthread_mutex_lock(&q->mutex);
+    while (!q->count && !q->finished) {
+        pthread_cond_wait(&q->not_empty, &q->mutex);
+    }
+    if (q->count) {
+        av_packet_move_ref(pkt, q->pkt_array[q->head_index]);
+        q->head_index = (q->head_index + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return ret;
+}
+
+//no more packets will be put, wakes the worker so it can drain the queue and flush its decoder
+static void packet_queue_finish(PacketQueue *q) {
+    pthread_mutex_lock(&q->mutex);
+    q->finished = 1;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static void decode_worker_packet(DecodeWorker *worker, AVPacket *pkt, AVFrame *frame) {
+    if (worker->codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+        decode_audio(worker->codec_ctx, pkt, frame, worker->audio_sink);
+    } else {
+        decode_video(worker->codec_ctx, pkt, frame, worker->video_out);
+    }
+}
 
-    //sampling_frequency_index 4bits
-    adts_header_buf[2] = adts_header_buf[2] | 3 << 2;
+static void *decode_worker_thread(void *arg) {
+    DecodeWorker *worker = (DecodeWorker *) arg;
+    AVPacket *pkt;
+    AVFrame *frame;
 
-    //private_bit 1bit
-    //adts_header_buf[2] = adts_header_buf[2] | 0;
+    if (!(pkt = av_packet_alloc()) || !(frame = av_frame_alloc())) {
+        fprintf(stderr, "Failed to alloc %s AVPacket/AVFrame\n", av_get_media_type_string(worker->codec_ctx->codec_type));
+        exit(1);
+    }
+    while (packet_queue_get(&worker->queue, pkt) >= 0) {
+        decode_worker_packet(worker, pkt, frame);
+        av_packet_unref(pkt);
+    }
+    /* flush the decoder, pkt is blank here */
+    decode_worker_packet(worker, pkt, frame);
+
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    return NULL;
+}
+
+/*
+** -parallel: the calling thread demuxes and feeds one decode thread per stream,
+** the audio and the video decode overlap instead of blocking each other.
+** return: succeed >= 0 or failed < 0
+*/
+static int decode_parallel(AVFormatContext *fmt_ctx, AVPacket *pkt, DecodeWorker *workers[], const int stream_indexes[], int nb_workers) {
+    int i, ret = 0, inited = 0, started = 0, nb_done = 0;
+
+    for (inited = 0; inited < nb_workers; inited++) {
+        if (packet_queue_init(&workers[inited]->queue, PACKET_QUEUE_SIZE) < 0) {
+            fprintf(stderr, "Failed to alloc packet queue\n");
+            packet_queue_destroy(&workers[inited]->queue);
+            ret = -1;
+            goto end;
+        }
+    }
+    for (started = 0; started < nb_workers; started++) {
+        if (pthread_create(&workers[started]->thread, NULL, decode_worker_thread, workers[started])) {
+            fprintf(stderr, "Failed to create decode thread\n");
+            ret = -1;
+            goto end;
+        }
+    }
 
-    //channel_configuration 3bits
-    //adts_header_buf[2] = adts_header_buf[2] | 0;
-    adts_header_buf[3] = 1 << 6;
+    //-to: 所有流都读到范围之后就停止读取
+    while (nb_done < nb_workers && av_read_frame(fmt_ctx, pkt) >= 0) {
+        for (i = 0; i < nb_workers; i++) {
+            if (stream_indexes[i] == pkt->stream_index && pkt->size > 0) {
+                if (packet_past_range_end(fmt_ctx, pkt)) {
+                    if (!workers[i]->range_done) {
+                        workers[i]->range_done = 1;
+                        nb_done++;
+                    }
+                } else if (!workers[i]->keyframes_only || (pkt->flags & AV_PKT_FLAG_KEY)) {
+                    packet_queue_put(&workers[i]->queue, pkt);
+                }
+                break;
+            }
+        }
+        av_packet_unref(pkt);
+    }
 
-    //originality 1bit
-    //adts_header_buf[3] = adts_header_buf[3] | 0;
+end:
+    for (i = 0; i < started; i++) {
+        packet_queue_finish(&workers[i]->queue);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i]->thread, NULL);
+    }
+    for (i = 0; i < inited; i++) {
+        packet_queue_destroy(&workers[i]->queue);
+    }
+    return ret;
+}
+#endif
 
-    //home 1bit
-    //adts_header_buf[3] = adts_header_buf[3] | 0;
+//return: succeed >= 0 or failed < 0 (unknown mode name)
+static int parse_thread_mode(enum CodecThreadMode *mode, const char *name) {
+    if (!strcmp(name, "auto")) {
+        *mode = CODEC_THREAD_AUTO;
+    } else if (!strcmp(name, "frame")) {
+        *mode = CODEC_THREAD_FRAME;
+    } else if (!strcmp(name, "slice")) {
+        *mode = CODEC_THREAD_SLICE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
 
-    //copyright_id_bit 1bit
-    //adts_header_buf[3] = adts_header_buf[3] | 0;
+static const char* get_thread_type_name(int thread_type) {
+    if (thread_type & FF_THREAD_FRAME) {
+        return "frame";
+    } else if (thread_type & FF_THREAD_SLICE) {
+        return "slice";
+    }
+    return "none";
+}
 
-    //copyright_id_start 1bit
-    //adts_header_buf[3] = adts_header_buf[3] | 0;
+//must be called before avcodec_open2
+static void set_codec_threading(AVCodecContext *codec_ctx, const AVCodec *decodec, const CodecOptions *opts) {
+    int caps = decodec->capabilities;
+    int thread_count = opts->thread_count > 0 ? opts->thread_count : FFMIN(av_cpu_count(), 16);
+    int thread_type = 0;
 
-    //frame_length 13bits
-    int length = frame_size + 7;
-    adts_header_buf[3] = adts_header_buf[3] | length >> 11;
-    adts_header_buf[4] = (length >> 3) & 0x1FF;
-    adts_header_buf[5] = (length & 0x7) << 5;
+    switch (opts->thread_mode) {
+    case CODEC_THREAD_FRAME:
+        thread_type = FF_THREAD_FRAME;
+        break;
+    case CODEC_THREAD_SLICE:
+        thread_type = FF_THREAD_SLICE;
+        break;
+    default:
+        if (codec_ctx->codec_type != AVMEDIA_TYPE_VIDEO) {
+            thread_count = 1;
+        }
+        thread_type = (caps & AV_CODEC_CAP_FRAME_THREADS) ? FF_THREAD_FRAME : FF_THREAD_SLICE;
+        break;
+    }
 
-    //adts_buffer_fullness 11bits
-    adts_header_buf[5] = adts_header_buf[5] | 0x1f;
-    adts_header_buf[6] = 0xfc;
+    if ((thread_type == FF_THREAD_FRAME && !(caps & AV_CODEC_CAP_FRAME_THREADS)) ||
+        (thread_type == FF_THREAD_SLICE && !(caps & AV_CODEC_CAP_SLICE_THREADS))) {
+        fprintf(stderr, "Warning: %s decoder does not support %s threading\n",
+                decodec->name, get_thread_type_name(thread_type));
+    }
 
-    //number_of_raw_data_blocks_in_frame 2bits
-    //adts_header_buf = adts_header_buf[5] | 0;
+    codec_ctx->thread_count = thread_count;
+    codec_ctx->thread_type = thread_type;
 }
 
 /*
 ** return: Returns the stream index of the lookup type
+** opts selects the decoder threading, NULL keeps the libavcodec defaults
 */
-int init_codec_context(AVCodecContext **codec_ctx, AVFormatContext *fmt_ctx, enum AVMediaType type) {
+int init_codec_context(AVCodecContext **codec_ctx, AVFormatContext *fmt_ctx, enum AVMediaType type, const CodecOptions *opts) {
     const AVStream *stream;
     const AVCodec *decodec;
     int ret = -1, stream_index = -1;
@@ -223,32 +609,428 @@ int init_codec_context(AVCodecContext **codec_ctx, AVFormatContext *fmt_ctx, enu
         fprintf(stderr, "Failed to get %s parameters from input AVFormatContext\n", av_get_media_type_string(type));
         return ret;
     }
+    //frame->best_effort_timestamp is in the stream time base
+    (*codec_ctx)->pkt_timebase = stream->time_base;
+    if (opts) {
+        set_codec_threading(*codec_ctx, decodec, opts);
+    }
     if ((ret = avcodec_open2(*codec_ctx, decodec, NULL)) < 0) {
         fprintf(stderr, "Failed to use %s decodec open\n", av_get_media_type_string(type));
         return ret;
     }
+    //report what the decoder actually runs with, it may fall back to fewer threads or no threading
+    fprintf(stderr, "%s decoder %s: %d thread(s), %s threading\n", av_get_media_type_string(type),
+            decodec->name, (*codec_ctx)->thread_count, get_thread_type_name((*codec_ctx)->active_thread_type));
     return stream_index;
 }
 
+#ifdef HAVE_PTHREADS
+/*
+** -gop_parallel: the video timeline is split into GOP-aligned ranges, one worker thread per range.
+** a worker opens the input again, seeks to the keyframe of its range and writes the decoded
+** frames of [start_pts, end_pts) to their slot frame_index * video_dst_bufsize of the output file
+*/
+typedef struct GopWorker {
+    const char *in_filename;
+    const char *out_filename;
+    CodecOptions codec_opts;
+    //sorted pts of all video frames of the input, the index is the frame number in the output
+    const int64_t *frame_pts;
+    int nb_frames;
+    //INT64_MIN for the first range, it is decoded from the start without seeking
+    int64_t start_pts;
+    //INT64_MAX for the last range
+    int64_t end_pts;
+    int frames_written;
+    int ret;
+    pthread_t thread;
+} GopWorker;
+
+static int compare_pts(const void *a, const void *b) {
+    int64_t pts_a = *(const int64_t *) a, pts_b = *(const int64_t *) b;
+    return pts_a < pts_b ? -1 : pts_a > pts_b;
+}
+
+//return: index of the first entry >= pts in the sorted array
+static int find_pts_index(const int64_t *pts_array, int count, int64_t pts) {
+    int low = 0, high = count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (pts_array[mid] < pts) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+//return: succeed >= 0 or failed < 0
+static int append_pts(int64_t **pts_array, int *count, int *capacity, int64_t pts) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 1024;
+        if (av_reallocp_array(pts_array, *capacity, sizeof(int64_t)) < 0) {
+            return -1;
+        }
+    }
+    (*pts_array)[(*count)++] = pts;
+    return 0;
+}
+
+/*
+** reads all video packets of the input without decoding them.
+** return: the number of video frames or failed < 0 (no video stream, or packets without pts).
+** *frame_pts: pts of all frames sorted, *key_pts: pts of the keyframes sorted
+*/
+static int scan_video_frames(const char *filename, int64_t **frame_pts, int64_t **key_pts, int *nb_keys) {
+    AVFormatContext *fmt_ctx = NULL;
+    AVPacket *pkt = NULL;
+    int ret, i, stream_index, nb_frames = 0, frames_size = 0, keys_size = 0;
+
+    *frame_pts = *key_pts = NULL;
+    *nb_keys = 0;
+    if ((ret = avformat_open_input(&fmt_ctx, filename, NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0) {
+        fprintf(stderr, "Failed to open input for the keyframe scan: %s\n", av_err2str(ret));
+        goto end;
+    }
+    if ((ret = stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
+        fprintf(stderr, "Failed to find video stream for the keyframe scan\n");
+        goto end;
+    }
+    for (i = 0; i < (int) fmt_ctx->nb_streams; i++) {
+        if (i != stream_index) {
+            fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    if (!(pkt = av_packet_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while (av_read_frame(fmt_ctx, pkt) >= 0) {
+        if (pkt->stream_index == stream_index && pkt->size > 0) {
+            if (pkt->pts == AV_NOPTS_VALUE) {
+                fprintf(stderr, "Video packets without pts can not be split into GOP ranges\n");
+                ret = -1;
+                goto end;
+            }
+            if (append_pts(frame_pts, &nb_frames, &frames_size, pkt->pts) < 0 ||
+                ((pkt->flags & AV_PKT_FLAG_KEY) && append_pts(key_pts, nb_keys, &keys_size, pkt->pts) < 0)) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+        }
+        av_packet_unref(pkt);
+    }
+    if (!*nb_keys) {
+        fprintf(stderr, "No keyframe found in the video stream\n");
+        ret = -1;
+        goto end;
+    }
+    qsort(*frame_pts, nb_frames, sizeof(int64_t), compare_pts);
+    qsort(*key_pts, *nb_keys, sizeof(int64_t), compare_pts);
+    ret = nb_frames;
+
+end:
+    if (ret < 0) {
+        av_freep(frame_pts);
+        av_freep(key_pts);
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&fmt_ctx);
+    return ret;
+}
+
+/*
+** decodes pkt and writes the frames inside the range of worker to their slot in out_file.
+** return: 1 once a frame past the range came out of the decoder, 0 to continue, < 0 on error
+*/
+static int decode_gop_packet(GopWorker *worker, AVCodecContext *codec_ctx, AVPacket *pkt, AVFrame *frame,
+                             FILE *out_file, uint8_t *buf) {
+    int ret, index;
+    int64_t pts;
+
+    if ((ret = avcodec_send_packet(codec_ctx, pkt)) < 0) {
+        fprintf(stderr, "Error sending a packet for decoding: %s\n", av_err2str(ret));
+        return ret;
+    }
+    for (;;) {
+        ret = avcodec_receive_frame(codec_ctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return 0;
+        } else if (ret < 0) {
+            fprintf(stderr, "Error during decoding: %s\n", av_err2str(ret));
+            return ret;
+        }
+        //解码器按pts顺序输出，出现范围外的帧说明本段的帧都已经输出，包括开放GOP中排在下个关键帧之后的前导帧
+        pts = frame->best_effort_timestamp;
+        if (pts >= worker->end_pts) {
+            av_frame_unref(frame);
+            return 1;
+        }
+        if (pts == AV_NOPTS_VALUE || pts < worker->start_pts ||
+            (index = find_pts_index(worker->frame_pts, worker->nb_frames, pts)) >= worker->nb_frames ||
+            worker->frame_pts[index] != pts) {
+            av_frame_unref(frame);
+            continue;
+        }
+        if (frame->width != width || frame->height != height || frame->format != pix_fmt) {
+            fprintf(stderr, "Error: frame %d changed the video geometry, it is left empty\n", index);
+            av_frame_unref(frame);
+            continue;
+        }
+
+        av_image_copy_to_buffer(buf, video_dst_bufsize, (const uint8_t * const *) frame->data, frame->linesize,
+                                pix_fmt, width, height, 1);
+        av_frame_unref(frame);
+        if (fseeko(out_file, (off_t) index * video_dst_bufsize, SEEK_SET) < 0 ||
+            fwrite(buf, 1, video_dst_bufsize, out_file) != (size_t) video_dst_bufsize) {
+            fprintf(stderr, "Failed to write video frame %d\n", index);
+            return -1;
+        }
+        worker->frames_written++;
+    }
+}
+
+static void *gop_worker_thread(void *arg) {
+    GopWorker *worker = (GopWorker *) arg;
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *codec_ctx = NULL;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    FILE *out_file = NULL;
+    uint8_t *buf = NULL;
+    int i, ret, stream_index, done = 0;
+
+    if ((ret = avformat_open_input(&fmt_ctx, worker->in_filename, NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0) {
+        fprintf(stderr, "Failed to open input in GOP worker: %s\n", av_err2str(ret));
+        goto end;
+    }
+    if ((ret = stream_index = init_codec_context(&codec_ctx, fmt_ctx, AVMEDIA_TYPE_VIDEO, &worker->codec_opts)) < 0) {
+        goto end;
+    }
+    for (i = 0; i < (int) fmt_ctx->nb_streams; i++) {
+        if (i != stream_index) {
+            fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    if (!(out_file = fopen(worker->out_filename, "r+b"))) {
+        fprintf(stderr, "Failed to open video output file in GOP worker\n");
+        ret = -1;
+        goto end;
+    }
+    if (!(pkt = av_packet_alloc()) || !(frame = av_frame_alloc()) || !(buf = av_malloc(video_dst_bufsize))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (worker->start_pts != INT64_MIN &&
+        (ret = av_seek_frame(fmt_ctx, stream_index, worker->start_pts, AVSEEK_FLAG_BACKWARD)) < 0) {
+        fprintf(stderr, "Failed to seek to keyframe %"PRId64": %s\n", worker->start_pts, av_err2str(ret));
+        goto end;
+    }
+
+    while (!done && av_read_frame(fmt_ctx, pkt) >= 0) {
+        if (pkt->stream_index == stream_index && pkt->size > 0) {
+            done = decode_gop_packet(worker, codec_ctx, pkt, frame, out_file, buf);
+        }
+        av_packet_unref(pkt);
+    }
+    /* flush the decoder at the end of the input */
+    if (!done) {
+        done = decode_gop_packet(worker, codec_ctx, pkt, frame, out_file, buf);
+    }
+    ret = done < 0 ? done : 0;
+
+end:
+    worker->ret = ret;
+    av_free(buf);
+    if (out_file && fclose(out_file) && ret >= 0) {
+        worker->ret = -1;
+    }
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&fmt_ctx);
+    return NULL;
+}
+
+/*
+** runs the GOP workers over the video of in_filename while the calling thread decodes
+** the audio stream of fmt_ctx into audio_sink.
+** return: succeed >= 0 or failed < 0
+*/
+static int decode_gop_parallel(const char *in_filename, VideoOutput *video_out,
+                               const CodecOptions *codec_opts, int nb_workers, AVFormatContext *fmt_ctx,
+                               AVCodecContext *acodec_ctx, int audio_stream_index, OutputSink *audio_sink) {
+    GopWorker *workers = NULL;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    int64_t *frame_pts = NULL, *key_pts = NULL;
+    int i, k, ret, nb_frames, nb_keys, nb_ranges = 0, started = 0, frames_written = 0;
+
+    if ((ret = nb_frames = scan_video_frames(in_filename, &frame_pts, &key_pts, &nb_keys)) < 0) {
+        goto end;
+    }
+    //按帧号定位写入，先把输出文件扩展到全部帧的大小
+    if (ftruncate(fileno(video_out->file), (off_t) nb_frames * video_dst_bufsize) < 0) {
+        fprintf(stderr, "Failed to preallocate the video output file\n");
+        ret = -1;
+        goto end;
+    }
+    if (!(workers = (GopWorker *) av_calloc(nb_workers, sizeof(GopWorker)))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    //按关键帧把时间线切成帧数大致相同的段，关键帧不够时段数少于nb_workers
+    for (i = 0, k = 0; i < nb_workers && k < nb_keys; i++) {
+        int64_t target = (int64_t) nb_frames * (i + 1) / nb_workers;
+        GopWorker *worker = &workers[i];
+
+        worker->in_filename = in_filename;
+        worker->out_filename = video_out->filename;
+        worker->codec_opts = *codec_opts;
+        //每个段一个解码器，默认把cpu核心平分给各段
+        if (!worker->codec_opts.thread_count) {
+            worker->codec_opts.thread_count = FFMAX(1, av_cpu_count() / nb_workers);
+        }
+        worker->frame_pts = frame_pts;
+        worker->nb_frames = nb_frames;
+        worker->start_pts = i ? key_pts[k] : INT64_MIN;
+        do {
+            k++;
+        } while (k < nb_keys && find_pts_index(frame_pts, nb_frames, key_pts[k]) < target);
+        worker->end_pts = k < nb_keys ? key_pts[k] : INT64_MAX;
+    }
+    nb_ranges = i;
+    fprintf(stderr, "decoding %d video frames in %d GOP range(s)\n", nb_frames, nb_ranges);
+
+    for (started = 0; started < nb_ranges; started++) {
+        if (pthread_create(&workers[started].thread, NULL, gop_worker_thread, &workers[started])) {
+            fprintf(stderr, "Failed to create GOP worker thread\n");
+            ret = -1;
+            goto end;
+        }
+    }
+
+    //视频由各段的线程解码，这里只解码音频
+    if (!acodec_ctx) {
+        goto end;
+    }
+    if (!(pkt = av_packet_alloc()) || !(frame = av_frame_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (i = 0; i < (int) fmt_ctx->nb_streams; i++) {
+        if (i != audio_stream_index) {
+            fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    while (av_read_frame(fmt_ctx, pkt) >= 0) {
+        if (pkt->stream_index == audio_stream_index && pkt->size > 0) {
+            decode_audio(acodec_ctx, pkt, frame, audio_sink);
+        }
+        av_packet_unref(pkt);
+    }
+    /* flush the audio decoder */
+    decode_audio(acodec_ctx, pkt, frame, audio_sink);
+
+end:
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].ret < 0) {
+            ret = workers[i].ret;
+        }
+        frames_written += workers[i].frames_written;
+    }
+    if (started) {
+        fprintf(stderr, "wrote %d of %d video frames\n", frames_written, nb_frames);
+        //每帧都有固定的位置，没有解出的帧留空，文件中始终是nb_frames帧
+        video_out->segment_frames = nb_frames;
+    }
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    av_free(workers);
+    av_free(frame_pts);
+    av_free(key_pts);
+    return ret < 0 ? ret : 0;
+}
+#endif
+
 int main(int argc, char* argv[]) {
     AVFormatContext* ifmt_ctx = NULL, * afmt_ctx = NULL, * vfmt_ctx = NULL;
     AVCodecContext* acodec_ctx = NULL, * vcodec_ctx = NULL;
     const AVCodec* acodec = NULL, * vcodec = NULL;
     AVPacket* pkt = NULL;
     AVFrame* frame = NULL;
-    FILE* in_file, * audio_out_file, * video_out_file;
+    FILE* in_file = NULL, * audio_out_file = NULL;
+    VideoOutput video_out = { 0 };
+    OutputSink* audio_sink = NULL;
     char* in_filename, * audio_out_filename, * video_out_filename, * data;
     Video_Para *video_para = NULL;
     Audio_Para *audio_para = NULL;
     char buf[STREAM_BUFFER_SIZE + STREAM_REFRESH_SIZE], header_buf[7];
     size_t data_size;
-    int ret, audio_stream_index, video_stream_index;
-    int n_channels;
+    int ret, i, audio_stream_index = -1, video_stream_index;
+    int n_channels, async_write = 0, parallel = 0, gop_parallel = 0;
+    int disable_audio = 0, keyframes_only = 0;
+    double start_seconds = -1, end_seconds = -1;
     enum AVSampleFormat sfmt;
     const char *fmt;
+    CodecOptions codec_opts = { CODEC_THREAD_AUTO, 0 };
 
     if (argc < 4) {
-        fprintf(stderr, "Using the following command: %s <input> <audio_filename> <video_filename>\n", argv[0]);
+        fprintf(stderr, "Using the following command: %s <input> <audio_filename> <video_filename> "
+                "[-threads <count>] [-thread_type auto|frame|slice] [-async_write] [-parallel] [-gop_parallel <workers>] "
+                "[-keyframes] [-an] [-frame_files] [-ss <seconds>] [-to <seconds>]\n", argv[0]);
+        exit(1);
+    }
+
+    for (i = 4; i < argc; i++) {
+        if (!strcmp(argv[i], "-threads") && i + 1 < argc) {
+            codec_opts.thread_count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-thread_type") && i + 1 < argc) {
+            if (parse_thread_mode(&codec_opts.thread_mode, argv[++i]) < 0) {
+                fprintf(stderr, "Unknown thread type %s, use auto, frame or slice\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "-async_write")) {
+            async_write = 1;
+        } else if (!strcmp(argv[i], "-parallel")) {
+            parallel = 1;
+        } else if (!strcmp(argv[i], "-gop_parallel") && i + 1 < argc) {
+            //0 means one worker per core
+            if ((gop_parallel = atoi(argv[++i])) <= 0) {
+                gop_parallel = av_cpu_count();
+            }
+        } else if (!strcmp(argv[i], "-keyframes")) {
+            keyframes_only = 1;
+        } else if (!strcmp(argv[i], "-an")) {
+            disable_audio = 1;
+        } else if (!strcmp(argv[i], "-frame_files")) {
+            frame_files_prefix = argv[3];
+        } else if (!strcmp(argv[i], "-ss") && i + 1 < argc) {
+            start_seconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-to") && i + 1 < argc) {
+            end_seconds = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+#ifndef HAVE_PTHREADS
+    if (parallel || gop_parallel) {
+        fprintf(stderr, "-parallel and -gop_parallel need POSIX threads, decoding serially\n");
+        parallel = gop_parallel = 0;
+    }
+#endif
+
+    //GOP分段按帧号写入同一个rawvideo文件，关键帧模式和逐帧文件没有固定的帧号
+    if (gop_parallel && (keyframes_only || frame_files_prefix || start_seconds >= 0 || end_seconds >= 0)) {
+        fprintf(stderr, "-gop_parallel can not be combined with -keyframes, -frame_files, -ss or -to\n");
         exit(1);
     }
 
@@ -269,6 +1051,24 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
+    //-ss/-to相对文件的起始时间，-ss时seek到它之前最近的关键帧，从那里解码并丢弃-ss之前的帧
+    if (start_seconds >= 0 || end_seconds >= 0) {
+        int64_t file_start = ifmt_ctx->start_time != AV_NOPTS_VALUE ? ifmt_ctx->start_time : 0;
+        if (start_seconds >= 0)
+            range_start = file_start + (int64_t) (start_seconds * AV_TIME_BASE);
+        if (end_seconds >= 0)
+            range_end = file_start + (int64_t) (end_seconds * AV_TIME_BASE);
+        if (range_start != AV_NOPTS_VALUE && range_end != AV_NOPTS_VALUE && range_end <= range_start) {
+            fprintf(stderr, "-to has to be after -ss\n");
+            exit(1);
+        }
+    }
+    if (range_start != AV_NOPTS_VALUE &&
+        (ret = av_seek_frame(ifmt_ctx, -1, range_start, AVSEEK_FLAG_BACKWARD)) < 0) {
+        fprintf(stderr, "Failed to seek to %.3f: %s\n", start_seconds, av_err2str(ret));
+        exit(1);
+    }
+
     /*
     if ((ret = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, -1)) < 0) {
         fprintf(stderr, "Failed to find audio stream: %s\n", av_err2str(ret));
@@ -294,16 +1094,18 @@ int main(int argc, char* argv[]) {
     }
     */
 
-    if ((audio_stream_index = init_codec_context(&acodec_ctx, ifmt_ctx, AVMEDIA_TYPE_AUDIO)) < 0) {
+    //-an: 不打开音频解码器
+    if (!disable_audio &&
+        (audio_stream_index = init_codec_context(&acodec_ctx, ifmt_ctx, AVMEDIA_TYPE_AUDIO, &codec_opts)) < 0) {
         fprintf(stderr, "Failed to init %s decodec context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
         goto end;
-    } else {
+    } else if (acodec_ctx) {
         audio_para = (Audio_Para *) malloc(sizeof(Audio_Para));
         audio_para->channels = acodec_ctx->ch_layout.nb_channels;
         audio_para->sample_rate = acodec_ctx->sample_rate;
     }
 
-    if ((video_stream_index = init_codec_context(&vcodec_ctx, ifmt_ctx, AVMEDIA_TYPE_VIDEO)) < 0) {
+    if ((video_stream_index = init_codec_context(&vcodec_ctx, ifmt_ctx, AVMEDIA_TYPE_VIDEO, &codec_opts)) < 0) {
         fprintf(stderr, "Failed to init %s decodec context\n", av_get_media_type_string(AVMEDIA_TYPE_VIDEO));
         goto end;
     } else {
@@ -323,6 +1125,17 @@ int main(int argc, char* argv[]) {
         }
         video_dst_bufsize = ret;
     }
+
+    //-keyframes: 解码器只解关键帧，demux时非关键帧的packet直接丢弃
+    if (keyframes_only) {
+        vcodec_ctx->skip_frame = AVDISCARD_NONKEY;
+    }
+    //不解码的流在demux时直接丢弃，-an时音频流也一起丢弃
+    for (i = 0; i < (int) ifmt_ctx->nb_streams; i++) {
+        if (i != video_stream_index && i != audio_stream_index) {
+            ifmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
     
 
     /*
@@ -355,13 +1168,20 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
-    if (!(audio_out_file = fopen(audio_out_filename, "wb"))) {
+    if (acodec_ctx && !(audio_out_file = fopen(audio_out_filename, "wb"))) {
         fprintf(stderr, "Failed to open audio output file\n");
         exit(1);
     }
 
-    if (!(video_out_file = fopen(video_out_filename, "wb"))) {
-        fprintf(stderr, "Failed to open video output file\n");
+    if (audio_out_file && !(audio_sink = output_sink_open(audio_out_file, async_write))) {
+        fprintf(stderr, "Failed to alloc audio output sink\n");
+        exit(1);
+    }
+
+    //-frame_files时每帧单独打开文件
+    video_out.filename = video_out_filename;
+    video_out.frame_rate = video_para->frame_rate;
+    if (open_video_segment(&video_out) < 0) {
         exit(1);
     }
 
@@ -375,30 +1195,62 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
-    while (av_read_frame(ifmt_ctx, pkt) >= 0) {
-        if (audio_stream_index == pkt->stream_index) {
-            if (pkt->size > 0) {
-                decode_audio(acodec_ctx, pkt, frame, audio_out_file);
-            }
-        } else if (video_stream_index == pkt->stream_index) {
-            if (pkt->size > 0) {
-                decode_video(vcodec_ctx, pkt, frame, video_out_file);
+#ifdef HAVE_PTHREADS
+    if (gop_parallel) {
+        if (decode_gop_parallel(in_filename, &video_out, &codec_opts, gop_parallel,
+                                ifmt_ctx, acodec_ctx, audio_stream_index, audio_sink) < 0) {
+            goto end;
+        }
+    } else if (parallel) {
+        DecodeWorker audio_worker = { 0 }, video_worker = { 0 };
+        DecodeWorker *workers[] = { &video_worker, &audio_worker };
+        const int stream_indexes[] = { video_stream_index, audio_stream_index };
+
+        video_worker.codec_ctx = vcodec_ctx;
+        video_worker.video_out = &video_out;
+        video_worker.keyframes_only = keyframes_only;
+        audio_worker.codec_ctx = acodec_ctx;
+        audio_worker.audio_sink = audio_sink;
+        //-an时只有视频线程
+        if (decode_parallel(ifmt_ctx, pkt, workers, stream_indexes, acodec_ctx ? 2 : 1) < 0) {
+            goto end;
+        }
+    } else
+#endif
+    {
+        //-to: 音视频都读到范围之后就停止读取，丢弃的流不用等
+        int audio_done = !acodec_ctx, video_done = 0;
+
+        while (!(audio_done && video_done) && av_read_frame(ifmt_ctx, pkt) >= 0) {
+            if (packet_past_range_end(ifmt_ctx, pkt)) {
+                if (audio_stream_index == pkt->stream_index)
+                    audio_done = 1;
+                else if (video_stream_index == pkt->stream_index)
+                    video_done = 1;
+            } else if (audio_stream_index == pkt->stream_index) {
+                if (pkt->size > 0) {
+                    decode_audio(acodec_ctx, pkt, frame, audio_sink);
+                }
+            } else if (video_stream_index == pkt->stream_index) {
+                if (pkt->size > 0 && (!keyframes_only || (pkt->flags & AV_PKT_FLAG_KEY))) {
+                    decode_video(vcodec_ctx, pkt, frame, &video_out);
+                }
             }
+            av_packet_unref(pkt);
         }
+
+        /* flush the decoders */
+        if (acodec_ctx)
+            decode_audio(acodec_ctx, pkt, frame, audio_sink);
+        if (vcodec_ctx)
+            decode_video(vcodec_ctx, pkt, frame, &video_out);
     }
 
-    /* flush the decoders */
-    if (acodec_ctx)
-        decode_audio(acodec_ctx, pkt, frame, audio_out_file);
-    if (vcodec_ctx)
-        decode_video(vcodec_ctx, pkt, frame, video_out_file);
+    //最后一个分段的sidecar，每个分段关闭时打印它的播放命令
+    close_video_segment(&video_out);
 
-    
-    printf("Play the output video file with the command:\n"
-            "ffplay -f rawvideo -framerate %.0f -video_size %dx%d %s\n",
-            video_para->frame_rate, video_para->width, video_para->height,
-            video_out_filename);
-    
+    if (!acodec_ctx)
+        goto end;
 
     sfmt = acodec_ctx->sample_fmt;
  
@@ -420,8 +1272,9 @@ int main(int argc, char* argv[]) {
            audio_out_filename);
 
 end:
-    if (video_out_file)
-        fclose(video_out_file);
+    if (output_sink_close(&audio_sink) < 0)
+        fprintf(stderr, "Failed to write audio output file\n");
+    close_video_segment(&video_out);
     if (audio_out_file)
         fclose(audio_out_file);
     if (in_file)
@@ -1,78 +1,278 @@
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <libavformat/avformat.h>
 #include <libavutil/log.h>
 #include <libavcodec/packet.h>
+#include "es_index.h"
+#include "adts_header.h"
 
-void get_adts_header(char* adts_header_buf, const int frame_length) {
-    //synword 12bits
-    adts_header_buf[0] = 0xff;
-    adts_header_buf[1] = 0xf << 4;
+//writev/mmap只在POSIX系统上有，其他平台（Windows）用stdio逐帧写出
+#if !defined(_WIN32)
+#   define ADTS_WRITER_HAVE_POSIX_IO 1
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/uio.h>
+#endif
 
-    //id 1bit
-    adts_header_buf[1] = adts_header_buf[1] | 0 << 3;
+//每个packet占两个iovec（ADTS头+数据），1024个iovec正好是Linux的IOV_MAX
+#define ADTS_BATCH_PACKETS 512
+//mmap模式下输出文件每次至少扩大这么多
+#define ADTS_MMAP_MIN_SIZE (16 << 20)
 
-    //layer 2bits
-    //adts_header_buf[1] = adts_header_buf[1] | 0 << 2;
-    
-    //protection_absent 1bit
-    adts_header_buf[1] = adts_header_buf[1] | 1;
-    
-    //pro 2bits
-    adts_header_buf[2] = 1 << 6;
+/*
+** Batched ADTS output.
+** packets stay referenced until ADTS_BATCH_PACKETS of them are queued, then all headers and
+** payloads go out in one writev(). in mmap mode the output file is preallocated and mapped,
+** frames are copied straight into the mapping, which doubles when full; the file is truncated
+** to the written size on close. without POSIX I/O every frame is written with fwrite() and
+** -mmap is ignored
+*/
+typedef struct ADTSWriter {
+    //bytes of the output file written or queued so far
+    int64_t offset;
 
-    //sampling_frequency_index 4bits
-    adts_header_buf[2] = adts_header_buf[2] | 3 << 2;
+#ifdef ADTS_WRITER_HAVE_POSIX_IO
+    int fd;
 
-    //private_bit 1bit
-    //adts_header_buf[2] = adts_header_buf[2] | 0;
+    AVPacket *pkts[ADTS_BATCH_PACKETS];
+    uint8_t headers[ADTS_BATCH_PACKETS][ADTS_HEADER_SIZE];
+    struct iovec iov[2 * ADTS_BATCH_PACKETS];
+    int nb_pkts;
 
-    //channel_configuration 3bits
-    //adts_header_buf[2] = adts_header_buf[2] | 0;
-    adts_header_buf[3] = 1 << 7;
+    uint8_t *map;
+    int64_t map_size;
+#else
+    FILE *file;
+#endif
+} ADTSWriter;
 
-    //originality 1bit
-    //adts_header_buf[3] = adts_header_buf[3] | 0;
+#ifdef ADTS_WRITER_HAVE_POSIX_IO
 
-    //home 1bit
-    //adts_header_buf[3] = adts_header_buf[3] | 0;
+//(re)maps the first size bytes of the output file, growing the file to size first
+static int adts_writer_map(ADTSWriter *w, int64_t size) {
+    int ret;
+
+    if (w->map) {
+        munmap(w->map, w->map_size);
+        w->map = NULL;
+    }
+    if (ftruncate(w->fd, size) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "preallocate output file failed: %s\n", strerror(errno));
+        return AVERROR(errno);
+    }
+    w->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+    if (w->map == MAP_FAILED) {
+        ret = AVERROR(errno);
+        w->map = NULL;
+        av_log(NULL, AV_LOG_ERROR, "mmap output file failed: %s\n", av_err2str(ret));
+        //去掉预分配的部分，文件只保留已经写入的数据
+        if (ftruncate(w->fd, w->offset) < 0) {
+            av_log(NULL, AV_LOG_WARNING, "truncate output file failed\n");
+        }
+        return ret;
+    }
+    w->map_size = size;
+    return 0;
+}
+#endif
 
-    //copyright_id_bit 1bit
-    //adts_header_buf[3] = adts_header_buf[3] | 0;
+/*
+** use_mmap: preallocate size_hint bytes (at least ADTS_MMAP_MIN_SIZE) and write through a mapping,
+** falls back to writev when the output can not be mapped (e.g. a pipe).
+** return: succeed >= 0 or failed < 0
+*/
+static int adts_writer_open(ADTSWriter *w, const char *filename, int use_mmap, int64_t size_hint) {
+#ifdef ADTS_WRITER_HAVE_POSIX_IO
+    int i;
 
-    //copyright_id_start 1bit
-    //adts_header_buf[3] = adts_header_buf[3] | 0;
+    memset(w, 0, sizeof(*w));
+    //mmap写入需要可读写打开
+    if ((w->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "open %s failed: %s\n", filename, strerror(errno));
+        return AVERROR(errno);
+    }
+    if (use_mmap && adts_writer_map(w, FFMAX(size_hint, ADTS_MMAP_MIN_SIZE)) >= 0) {
+        return 0;
+    }
+    if (use_mmap) {
+        av_log(NULL, AV_LOG_WARNING, "writing %s with writev instead\n", filename);
+    }
+    for (i = 0; i < ADTS_BATCH_PACKETS; i++) {
+        if (!(w->pkts[i] = av_packet_alloc())) {
+            return AVERROR(ENOMEM);
+        }
+    }
+    return 0;
+#else
+    (void) size_hint;
+    memset(w, 0, sizeof(*w));
+    if (!(w->file = fopen(filename, "wb"))) {
+        av_log(NULL, AV_LOG_ERROR, "open %s failed: %s\n", filename, strerror(errno));
+        return AVERROR(errno);
+    }
+    if (use_mmap) {
+        av_log(NULL, AV_LOG_WARNING, "no mmap on this platform, writing %s with fwrite\n", filename);
+    }
+    return 0;
+#endif
+}
+
+#ifdef ADTS_WRITER_HAVE_POSIX_IO
+//writes the queued packets with writev() and releases them
+static int adts_writer_flush(ADTSWriter *w) {
+    struct iovec *iov = w->iov;
+    int iovcnt = 2 * w->nb_pkts;
+    ssize_t written;
+    int i, ret = 0;
+
+    while (iovcnt > 0) {
+        written = writev(w->fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            av_log(NULL, AV_LOG_ERROR, "write ADTS data failed: %s\n", strerror(errno));
+            ret = AVERROR(errno);
+            break;
+        }
+        //部分写入时跳过已经写完的iovec，从写了一半的那个继续
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    for (i = 0; i < w->nb_pkts; i++) {
+        av_packet_unref(w->pkts[i]);
+    }
+    w->nb_pkts = 0;
+    return ret;
+}
+#endif
+
+/*
+** queues one frame, the payload reference is taken over from pkt (pkt is blank afterwards).
+** header: the ADTS header of this frame, copied.
+** return: succeed >= 0 or failed < 0
+*/
+static int adts_writer_write(ADTSWriter *w, const uint8_t *header, AVPacket *pkt) {
+    int64_t size = ADTS_HEADER_SIZE + pkt->size;
+#ifdef ADTS_WRITER_HAVE_POSIX_IO
+    int n = w->nb_pkts;
+    int ret;
+
+    if (w->map) {
+        if (w->offset + size > w->map_size &&
+            (ret = adts_writer_map(w, FFMAX(2 * w->map_size, w->offset + size))) < 0) {
+            return ret;
+        }
+        memcpy(w->map + w->offset, header, ADTS_HEADER_SIZE);
+        memcpy(w->map + w->offset + ADTS_HEADER_SIZE, pkt->data, pkt->size);
+        w->offset += size;
+        av_packet_unref(pkt);
+        return 0;
+    }
+
+    memcpy(w->headers[n], header, ADTS_HEADER_SIZE);
+    av_packet_move_ref(w->pkts[n], pkt);
+    w->iov[2 * n].iov_base     = w->headers[n];
+    w->iov[2 * n].iov_len      = ADTS_HEADER_SIZE;
+    w->iov[2 * n + 1].iov_base = w->pkts[n]->data;
+    w->iov[2 * n + 1].iov_len  = w->pkts[n]->size;
+    w->offset += size;
+    if (++w->nb_pkts == ADTS_BATCH_PACKETS) {
+        return adts_writer_flush(w);
+    }
+    return 0;
+#else
+    //stdio自带缓冲，头和数据直接写出
+    if (fwrite(header, 1, ADTS_HEADER_SIZE, w->file) != ADTS_HEADER_SIZE ||
+        fwrite(pkt->data, 1, pkt->size, w->file) != (size_t) pkt->size) {
+        av_log(NULL, AV_LOG_ERROR, "write ADTS data failed: %s\n", strerror(errno));
+        av_packet_unref(pkt);
+        return AVERROR(EIO);
+    }
+    w->offset += size;
+    av_packet_unref(pkt);
+    return 0;
+#endif
+}
 
-    //frame_length 13bits
-    int length = frame_length + 7;
-    adts_header_buf[3] = adts_header_buf[3] | length >> 11;
-    adts_header_buf[4] = (length >> 3) & 0x1FF;
-    adts_header_buf[5] = (length & 0x7) << 5;
+//writes what is still queued and closes the output. return: succeed >= 0 or failed < 0
+static int adts_writer_close(ADTSWriter *w) {
+#ifdef ADTS_WRITER_HAVE_POSIX_IO
+    int ret = 0, i;
 
-    //adts_buffer_fullness 11bits
-    adts_header_buf[5] = adts_header_buf[5] | 0x1f;
-    adts_header_buf[6] = 0xfc;
+    if (w->fd < 0) {
+        return 0;
+    }
+    if (w->map) {
+        munmap(w->map, w->map_size);
+        w->map = NULL;
+        //去掉预分配但没有用到的部分
+        if (ftruncate(w->fd, w->offset) < 0) {
+            ret = AVERROR(errno);
+        }
+    } else {
+        ret = adts_writer_flush(w);
+    }
+    for (i = 0; i < ADTS_BATCH_PACKETS; i++) {
+        av_packet_free(&w->pkts[i]);
+    }
+    if (close(w->fd) < 0 && ret >= 0) {
+        ret = AVERROR(errno);
+    }
+    w->fd = -1;
+    return ret;
+#else
+    int ret = 0;
 
-    //number_of_raw_data_blocks_in_frame 2bits
-    //adts_header_buf = adts_header_buf[5] | 0;
+    if (!w->file) {
+        return 0;
+    }
+    if (fclose(w->file) != 0) {
+        ret = AVERROR(EIO);
+    }
+    w->file = NULL;
+    return ret;
+#endif
 }
 
 int main(int argc, char* argv[]) {
     AVFormatContext* fmt_ctx = NULL;
     AVPacket* pkt = NULL;
-    FILE* file = NULL;
+    ADTSWriter* writer = NULL;
     char* in_file = NULL;
     char* out_file = NULL;
-    int ret, len;
+    FILE* index_file = NULL;
+    //写入或关闭输出失败时以非0退出
+    int ret = AVERROR(EINVAL), i, stream_index;
+    int64_t size_hint, frame_offset, frame_pts, frame_dts;
+    uint32_t frame_size;
+    uint8_t adts_header_buf[ADTS_HEADER_SIZE];
+    //-mmap: 预分配输出文件并通过mmap写入
+    int use_mmap = 0, arg = 1;
 
     av_log_set_level(AV_LOG_INFO);
     
-    if (argc < 3) {
+    if (argc > 1 && !strcmp(argv[1], "-mmap")) {
+        use_mmap = 1;
+        arg++;
+    }
+    if (argc - arg < 2) {
 	av_log(NULL, AV_LOG_ERROR, "parameters are less than three");
     	goto release;
     }
 
-    in_file = argv[1];
-    out_file = argv[2];
+    in_file = argv[arg];
+    out_file = argv[arg + 1];
     ret = avformat_open_input(&fmt_ctx, in_file, NULL, NULL);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "open file failed: %s\n", av_err2str(ret));
@@ -80,25 +280,76 @@ int main(int argc, char* argv[]) {
     }
 
     av_dump_format(fmt_ctx, 0, in_file, 0);
-    file = fopen(out_file, "wb");
-    if (!file) {
-    	av_log(NULL, AV_LOG_ERROR, "open %s failed!\n", out_file);
-	goto release;
-    }
 
     ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, -1);
     if (ret < 0) {
 	av_log(NULL, AV_LOG_ERROR, "find audio stream failed%s\n", av_err2str(ret));
+	goto release;
+    }
+    stream_index = ret;
+
+    //ADTS头只按流的AudioSpecificConfig生成一次，每个packet只改写frame_length
+    if ((ret = adts_header_init(adts_header_buf, fmt_ctx->streams[stream_index]->codecpar)) < 0) {
+	av_log(NULL, AV_LOG_ERROR, "build ADTS header failed: %s\n", av_err2str(ret));
+	goto release;
+    }
+
+    //可选的第三个参数：帧索引文件，记录每个ADTS帧在输出文件中的位置，方便随机访问
+    if (argc - arg > 2 && !(index_file = es_index_open(argv[arg + 2], fmt_ctx->streams[stream_index]->time_base))) {
+	ret = AVERROR(EIO);
+	goto release;
+    }
+
+    //按时长和码率估算输出大小，再加上ADTS头和余量，不够时写入过程中再扩大
+    size_hint = 0;
+    if (fmt_ctx->duration > 0 && fmt_ctx->streams[stream_index]->codecpar->bit_rate > 0) {
+        size_hint = av_rescale(fmt_ctx->duration, fmt_ctx->streams[stream_index]->codecpar->bit_rate,
+                               8LL * AV_TIME_BASE);
+        size_hint += size_hint / 8;
+    }
+    if (!(writer = av_malloc(sizeof(*writer)))) {
+	ret = AVERROR(ENOMEM);
+	goto release;
+    }
+    if ((ret = adts_writer_open(writer, out_file, use_mmap, size_hint)) < 0) {
+	adts_writer_close(writer);
+	av_freep(&writer);
+	goto release;
+    }
+
+    //其他流在demux时直接丢弃，libavformat不再为它们读数据和分配packet
+    for (i = 0; i < (int) fmt_ctx->nb_streams; i++) {
+        if (i != stream_index) {
+            fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    if (!(pkt = av_packet_alloc())) {
+	av_log(NULL, AV_LOG_ERROR, "alloc packet failed\n");
+	ret = AVERROR(ENOMEM);
+	goto release;
     }
-    pkt = av_packet_alloc();
     while (av_read_frame(fmt_ctx, pkt) >= 0) {
-    	if (pkt->stream_index == ret) {
-    	    char adts_header_buf[7] = {0};
-            get_adts_header(adts_header_buf, pkt->size);
-	    fwrite(adts_header_buf, 1, 7, file);
-	    len = fwrite(pkt->data, 1, pkt->size, file);  
-	    if (len < pkt->size) {
-		av_log(NULL, AV_LOG_WARNING, "Waring: Data not fully written!\n");
+    	if (pkt->stream_index == stream_index) {
+	    if (adts_header_set_length(adts_header_buf, pkt->size) < 0) {
+		av_log(NULL, AV_LOG_WARNING, "skip AAC packet of %d bytes, too large for ADTS\n", pkt->size);
+		av_packet_unref(pkt);
+		continue;
+	    }
+	    //writer会接管packet的数据，索引需要的字段先记下来
+	    frame_offset = writer->offset;
+	    frame_size   = ADTS_HEADER_SIZE + pkt->size;
+	    frame_pts    = pkt->pts;
+	    frame_dts    = pkt->dts;
+	    //packet的数据交给writer，攒够一批后一次writev写出
+	    if ((ret = adts_writer_write(writer, adts_header_buf, pkt)) < 0) {
+		break;
+	    }
+	    //写入成功后才记索引，索引里不会有指向未写出数据的条目
+	    //AAC每一帧都可以独立解码，都标记为关键帧
+	    if (index_file && es_index_add(index_file, frame_offset, frame_size, 0, ES_INDEX_FLAG_KEY,
+	                                   frame_pts, frame_dts) < 0) {
+		av_log(NULL, AV_LOG_WARNING, "write frame index failed\n");
 	    }
 	}
 	av_packet_unref(pkt);
@@ -111,9 +362,20 @@ release:
     if (pkt) {
 	av_packet_free(&pkt);
     }
-    if (file) {
-        fclose(file);
+    if (writer) {
+        if (adts_writer_close(writer) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Data not fully written!\n");
+            ret = AVERROR(EIO);
+        }
+        av_freep(&writer);
+    }
+    if (index_file) {
+        //缓冲中最后的索引条目在fclose时才真正写出
+        if (fclose(index_file) != 0) {
+            av_log(NULL, AV_LOG_ERROR, "Frame index not fully written!\n");
+            ret = AVERROR(EIO);
+        }
     }
     
-    return 0;
+    return ret < 0 ? 1 : 0;
 }
@@ -2,6 +2,7 @@
 #include <libavformat/avformat.h>
 #include <libavutil/log.h>
 #include <libavcodec/packet.h>
+#include "es_index.h"
 
 #ifndef AV_WB32
 #   define AV_WB32(p, val) do {                 \
@@ -18,35 +19,45 @@
     ((((const uint8_t*)(x))[0] << 8) |          \
       ((const uint8_t*)(x))[1])
 #endif
-// 添加startcode
-static int alloc_and_copy(AVPacket *out,
-                          const uint8_t *sps_pps, uint32_t sps_pps_size,
-                          const uint8_t *in, uint32_t in_size)
+
+#ifndef AV_RB24
+#   define AV_RB24(x)                                \
+    ((((const uint8_t*)(x))[0] << 16) |              \
+     (((const uint8_t*)(x))[1] <<  8) |              \
+      ((const uint8_t*)(x))[2])
+#endif
+
+#ifndef AV_RB32
+#   define AV_RB32(x)                                \
+    (((uint32_t)((const uint8_t*)(x))[0] << 24) |    \
+               (((const uint8_t*)(x))[1] << 16) |    \
+               (((const uint8_t*)(x))[2] <<  8) |    \
+                ((const uint8_t*)(x))[3])
+#endif
+// 添加startcode：access unit的第一个NAL和SPS/PPS之后的NAL用 00 00 00 01，其余的用 00 00 01
+// return: the end of the copied data in out
+static uint8_t *copy_with_startcode(uint8_t *out,
+                                    const uint8_t *sps_pps, uint32_t sps_pps_size,
+                                    const uint8_t *in, uint32_t in_size, int long_startcode)
 {
-    uint32_t offset         = out->size;
-    uint8_t nal_header_size = 4;
-    int err;
-        //扩充out 容量
-    err = av_grow_packet(out, sps_pps_size + in_size + nal_header_size);
-    if (err < 0)
-        return err;
-
-    if (sps_pps)
-        // 写入sps pps  第一个参数是找写入位置
-        memcpy(out->data + offset, sps_pps, sps_pps_size);
-    // 写入原始数据
-    memcpy(out->data + sps_pps_size + nal_header_size + offset, in, in_size);
-    if (!offset) {
-        // 000001
-        AV_WB32(out->data + sps_pps_size, 1);
-    } else {
+    if (sps_pps) {
+        // 写入sps pps
+        memcpy(out, sps_pps, sps_pps_size);
+        out += sps_pps_size;
+    }
+    if (long_startcode) {
         // 00000001
-        (out->data + offset + sps_pps_size)[0] =
-        (out->data + offset + sps_pps_size)[1] = 0;
-        (out->data + offset + sps_pps_size)[2] = 1;
+        AV_WB32(out, 1);
+        out += 4;
+    } else {
+        // 000001
+        out[0] = out[1] = 0;
+        out[2] = 1;
+        out += 3;
     }
-
-    return 0;
+    // 写入原始数据
+    memcpy(out, in, in_size);
+    return out + in_size;
 }
 
 int h264_extradata_to_annexb(const uint8_t *codec_extradata, const int codec_extradata_size, AVPacket *out_extradata, int padding)
@@ -160,94 +171,340 @@ pps:
     return 0;
 }
 
-int h264_mp4toannexb(AVFormatContext *fmt_ctx, AVPacket *in, FILE *dst_fd)
+/**
+ * HVCC
+ * bits
+ *  8   configurationVersion ( always 0x01 )
+ *  ... 20 bytes of profile / tier / level / chroma / bit depth fields
+ *  6   reserved ( all bits on ) + 2 constantFrameRate/numTemporalLayers/temporalIdNested bits
+ *  2   lengthSizeMinusOne       // 第22个字节的低2位，和avcC一样是（前缀长度-1）
+ *  8   numOfArrays
+ *
+ *  repeated once per array:
+ *  1   array_completeness  1 reserved  6 NAL_unit_type ( VPS 32, SPS 33, PPS 34, SEI 39/40 )
+ *  16  numNalus
+ *  repeated once per NAL unit:
+ *  16  nalUnitLength
+ *  variable NAL unit data
+ */
+int hevc_extradata_to_annexb(const uint8_t *codec_extradata, const int codec_extradata_size, AVPacket *out_extradata, int padding)
 {
+    static const uint8_t nalu_header[4] = { 0, 0, 0, 1 };
+    const uint8_t *extradata     = codec_extradata + 22;
+    const uint8_t *extradata_end = codec_extradata + codec_extradata_size;
+    uint64_t total_size = 0;
+    uint8_t *out        = NULL;
+    int num_arrays, i, j, unit_nb, unit_size, err;
+
+    num_arrays = *extradata++;
+    for (i = 0; i < num_arrays; i++) {
+        if (extradata + 3 > extradata_end)
+            goto invalid;
+        //数组头的低6位是NAL类型，这里所有数组（VPS/SPS/PPS/SEI）都按顺序输出
+        unit_nb = AV_RB16(extradata + 1);
+        extradata += 3;
+
+        for (j = 0; j < unit_nb; j++) {
+            if (extradata + 2 > extradata_end)
+                goto invalid;
+            unit_size = AV_RB16(extradata);
+            if (extradata + 2 + unit_size > extradata_end)
+                goto invalid;
+
+            total_size += unit_size + 4;
+            if (total_size > (uint64_t) (INT_MAX - padding))
+                goto invalid;
+            if ((err = av_reallocp(&out, total_size + padding)) < 0)
+                return err;
+
+            memcpy(out + total_size - unit_size - 4, nalu_header, 4);
+            memcpy(out + total_size - unit_size, extradata + 2, unit_size);
+            extradata += 2 + unit_size;
+        }
+    }
+
+    if (out)
+        memset(out + total_size, 0, padding);
+    else
+        av_log(NULL, AV_LOG_WARNING,
+               "Warning: VPS/SPS/PPS NALU missing or invalid. "
+               "The resulting stream may not play.\n");
+
+    out_extradata->data      = out;
+    out_extradata->size      = total_size;
+    return 0;
 
-    AVPacket *out = NULL;
-    AVPacket spspps_pkt;
+invalid:
+    av_log(NULL, AV_LOG_ERROR, "Corrupted stream or invalid hvcC extradata\n");
+    av_free(out);
+    return AVERROR(EINVAL);
+}
+
+/*
+** Elementary stream export of H.264 / HEVC video to Annex B.
+** the parameter sets (SPS/PPS, plus VPS for HEVC) of the stream are kept in Annex B form
+** (00 00 00 01 NAL 00 00 00 01 NAL ...), parsed once from the avcC/hvcC extradata and again
+** only when a packet carries new extradata. streams whose extradata is already Annex B
+** (e.g. from MPEG-TS) are passed through unchanged
+*/
+typedef struct AnnexBContext {
+    enum AVCodecID codec_id;
+    uint8_t *ps;
+    int ps_size;
+    //bytes of the NAL length prefix in the packets, lengthSizeMinusOne + 1 from avcC/hvcC
+    int length_size;
+    //packets are already Annex B
+    int passthrough;
+    //NAL type of the first slice of the last converted packet, -1 when unknown
+    int vcl_type;
+    //the converted access unit, the buffer is reused and only grows
+    uint8_t *out;
+    unsigned int out_size;
+    //receives every converted packet in one call, annexb_write_file writes it to the AnnexBOutput in opaque
+    int (*write_packet)(void *opaque, const uint8_t *data, int size);
+    void *opaque;
+} AnnexBContext;
+
+//output file of the exported stream, offset counts the bytes written so far for the frame index
+typedef struct AnnexBOutput {
+    FILE *file;
+    int64_t offset;
+} AnnexBOutput;
+
+static int annexb_write_file(void *opaque, const uint8_t *data, int size)
+{
+    AnnexBOutput *output = (AnnexBOutput *) opaque;
+
+    if (fwrite(data, 1, size, output->file) != (size_t) size) {
+        av_log(NULL, AV_LOG_ERROR, "write annexb data failed\n");
+        return AVERROR(EIO);
+    }
+    output->offset += size;
+    return 0;
+}
+
+static int annexb_nal_type(const AnnexBContext *ctx, const uint8_t *nal)
+{
+    //H.264的NAL类型在第一个字节的低5位，HEVC在第一个字节的第1到6位
+    return ctx->codec_id == AV_CODEC_ID_HEVC ? (nal[0] >> 1) & 0x3f : nal[0] & 0x1f;
+}
+
+static int annexb_is_parameter_set(const AnnexBContext *ctx, int type)
+{
+    //HEVC: VPS 32, SPS 33, PPS 34; H.264: SPS 7, PPS 8
+    return ctx->codec_id == AV_CODEC_ID_HEVC ? type >= 32 && type <= 34 : type == 7 || type == 8;
+}
+
+static int annexb_is_vcl(const AnnexBContext *ctx, int type)
+{
+    //HEVC: 0..31; H.264: 1..5
+    return ctx->codec_id == AV_CODEC_ID_HEVC ? type < 32 : type >= 1 && type <= 5;
+}
+
+static int annexb_is_irap(const AnnexBContext *ctx, int type)
+{
+    //HEVC: BLA/IDR/CRA 16..23; H.264: IDR 5
+    return ctx->codec_id == AV_CODEC_ID_HEVC ? type >= 16 && type <= 23 : type == 5;
+}
+
+static uint32_t annexb_read_nal_size(const uint8_t *buf, int length_size)
+{
+    uint32_t nal_size = 0;
+    int i;
+    for (i = 0; i < length_size; i++)
+        nal_size = (nal_size << 8) | buf[i];
+    return nal_size;
+}
+
+//return: succeed >= 0 or failed < 0, the cached parameter sets are kept on failure
+static int annexb_update_parameter_sets(AnnexBContext *ctx, const uint8_t *extradata, int extradata_size)
+{
+    AVPacket ps_pkt = { 0 };
+    int ret, length_size;
+
+    //没有extradata或者extradata以startcode开头时，packet本身就是Annex B
+    if (!extradata || extradata_size < 4 || !AV_RB24(extradata) || AV_RB24(extradata) == 1) {
+        ctx->passthrough = 1;
+        return 0;
+    }
 
-    int len;
-    uint8_t unit_type;
-    int32_t nal_size;
-    uint32_t cumul_size    = 0;
+    if (ctx->codec_id == AV_CODEC_ID_HEVC) {
+        //hvcC头部固定23个字节，之后才是参数集数组
+        if (extradata_size < 23) {
+            av_log(NULL, AV_LOG_ERROR, "invalid hvcC extradata\n");
+            return AVERROR(EINVAL);
+        }
+        length_size = (extradata[21] & 0x3) + 1;
+        ret = hevc_extradata_to_annexb(extradata, extradata_size, &ps_pkt, AV_INPUT_BUFFER_PADDING_SIZE);
+    } else {
+        //avcC头部至少有7个字节：版本、profile、兼容性、level、长度字节数、SPS个数、PPS个数
+        if (extradata_size < 7) {
+            av_log(NULL, AV_LOG_ERROR, "invalid avcC extradata\n");
+            return AVERROR(EINVAL);
+        }
+        length_size = (extradata[4] & 0x3) + 1;
+        ret = h264_extradata_to_annexb(extradata, extradata_size, &ps_pkt, AV_INPUT_BUFFER_PADDING_SIZE);
+    }
+    if (ret < 0)
+        return ret;
+
+    av_free(ctx->ps);
+    ctx->ps          = ps_pkt.data;
+    ctx->ps_size     = ps_pkt.size;
+    ctx->length_size = length_size;
+    ctx->passthrough = 0;
+    return 0;
+}
+
+//return: succeed >= 0 or failed < 0 (not H.264/HEVC, or invalid extradata)
+static int annexb_init(AnnexBContext *ctx, const AVCodecParameters *par,
+                       int (*write_packet)(void *opaque, const uint8_t *data, int size), void *opaque)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    if (par->codec_id != AV_CODEC_ID_H264 && par->codec_id != AV_CODEC_ID_HEVC) {
+        av_log(NULL, AV_LOG_ERROR, "only H.264 and HEVC can be exported as Annex B\n");
+        return AVERROR(ENOSYS);
+    }
+    ctx->codec_id     = par->codec_id;
+    ctx->write_packet = write_packet;
+    ctx->opaque       = opaque;
+    return annexb_update_parameter_sets(ctx, par->extradata, par->extradata_size);
+}
+
+static void annexb_uninit(AnnexBContext *ctx)
+{
+    av_freep(&ctx->ps);
+    ctx->ps_size = 0;
+    av_freep(&ctx->out);
+    ctx->out_size = 0;
+}
+
+/*
+** checks the NAL lengths of a length-prefixed packet and sets ctx->vcl_type.
+** return: succeed >= 0 or failed < 0 on invalid data. *nb_nals: number of NAL units,
+** *insert_ps: an IRAP picture comes before any parameter set, the cached ones go in front of it
+*/
+static int annexb_scan_packet(AnnexBContext *ctx, const AVPacket *in, int *nb_nals, int *insert_ps)
+{
+    const uint8_t *buf     = in->data;
+    const uint8_t *buf_end = in->data + in->size;
+    uint8_t ps_in_packet = 0;
+    uint32_t nal_size;
+    int type;
+
+    *nb_nals   = 0;
+    *insert_ps = 0;
+    while (buf < buf_end) {
+        if (buf_end - buf < ctx->length_size)
+            return AVERROR(EINVAL);
+        nal_size = annexb_read_nal_size(buf, ctx->length_size);
+        buf += ctx->length_size;
+        if (nal_size > (uint32_t) (buf_end - buf))
+            return AVERROR(EINVAL);
+
+        if (nal_size) {
+            type = annexb_nal_type(ctx, buf);
+            if (ctx->vcl_type < 0 && annexb_is_vcl(ctx, type))
+                ctx->vcl_type = type;
+            if (annexb_is_parameter_set(ctx, type))
+                ps_in_packet = 1;
+            else if (annexb_is_irap(ctx, type) && !ps_in_packet && !*insert_ps)
+                *insert_ps = 1;
+        }
+        (*nb_nals)++;
+        buf += nal_size;
+    }
+    return 0;
+}
+
+/*
+** converts one packet of the stream to Annex B and hands the whole access unit to ctx->write_packet.
+** packets with 4-byte lengths that need no parameter sets are rewritten inside in,
+** which is made writable first
+*/
+int annexb_export_packet(AnnexBContext *ctx, AVPacket *in)
+{
+    const uint8_t *new_extradata;
+    size_t new_extradata_size;
+    uint8_t ps_written = 0;
+
+    uint32_t nal_size;
     const uint8_t *buf;
     const uint8_t *buf_end;
-    int            buf_size;
-    int ret = 0, i;
+    uint8_t *out, *nal;
+    int ret, nb_nals, insert_ps;
+
+    //码流中途参数集变化时（例如拼接的片段），demuxer把新的avcC/hvcC作为side data带在packet上
+    new_extradata = av_packet_get_side_data(in, AV_PKT_DATA_NEW_EXTRADATA, &new_extradata_size);
+    //解析失败时保留之前的参数集继续输出，不丢掉这个access unit
+    if (new_extradata && new_extradata_size > 0 &&
+        (ret = annexb_update_parameter_sets(ctx, new_extradata, new_extradata_size)) < 0) {
+        if (ret == AVERROR(ENOMEM))
+            return ret;
+        av_log(NULL, AV_LOG_WARNING,
+               "Invalid new extradata in packet, keeping the previous parameter sets\n");
+    }
 
-    out = av_packet_alloc();
+    ctx->vcl_type = -1;
+    if (ctx->passthrough)
+        return ctx->write_packet(ctx->opaque, in->data, in->size);
+
+    if ((ret = annexb_scan_packet(ctx, in, &nb_nals, &insert_ps)) < 0)
+        return ret;
+
+    if (ctx->length_size == 4 && !insert_ps) {
+        //00 00 00 01 和4字节的长度一样长，直接在packet里改写，不用拷贝
+        //demuxer给出的packet一般只有一个引用，make_writable不会真的拷贝
+        if ((ret = av_packet_make_writable(in)) < 0)
+            return ret;
+        for (nal = in->data; nal < in->data + in->size; nal += 4 + nal_size) {
+            nal_size = AV_RB32(nal);
+            AV_WB32(nal, 1);
+        }
+        return ctx->write_packet(ctx->opaque, in->data, in->size);
+    }
+
+    //每个NAL的startcode最多4个字节，比长度前缀多出4 - length_size，整个packet最多再多出一份参数集
+    av_fast_padded_malloc(&ctx->out, &ctx->out_size,
+                          (size_t) in->size + (size_t) nb_nals * (4 - ctx->length_size) + ctx->ps_size);
+    if (!ctx->out)
+        return AVERROR(ENOMEM);
+    out = ctx->out;
 
     buf      = in->data;
-    buf_size = in->size;
     buf_end  = in->data + in->size;
 
-    do {
-        ret= AVERROR(EINVAL);
-        //因为每个视频帧的前 4 个字节是视频帧的长度
-        //如果buf中的数据都不能满足4字节，所以后面就没有必要再进行处理了
-        if (buf + 4 > buf_end)
-            goto fail;
-
-        //将前四字节转换成整型,也就是取出视频帧长度
-        for (nal_size = 0, i = 0; i<4; i++)
-            nal_size = (nal_size << 8) | buf[i];
-
-        buf += 4; //跳过4字节（也就是视频帧长度），从而指向真正的视频帧数据 
-        unit_type = *buf & 0x1f; //视频帧的第一个字节里有NAL TYPE
-
-        //如果视频帧长度大于从 AVPacket 中读到的数据大小，说明这个数据包肯定是出错了
-        if (nal_size > buf_end - buf || nal_size < 0)
-            goto fail;
-
-        /* prepend only to the first type 5 NAL unit of an IDR picture, if no sps/pps are already present */
-        if (unit_type == 5) {
-
-            //在每个I帧之前都加 SPS/PPS
-            h264_extradata_to_annexb( fmt_ctx->streams[in->stream_index]->codecpar->extradata,
-                                      fmt_ctx->streams[in->stream_index]->codecpar->extradata_size,
-                                      &spspps_pkt,
-                                      AV_INPUT_BUFFER_PADDING_SIZE);
-            /**
-                                    不太懂
-             */
-            if ((ret=alloc_and_copy(out,
-                               spspps_pkt.data, spspps_pkt.size,
-                               buf, nal_size)) < 0)
-                goto fail;
-        } else {
-            if ((ret=alloc_and_copy(out, NULL, 0, buf, nal_size)) < 0)
-                goto fail;
-        }
-
+    while (buf < buf_end) {
+        //长度已经在annexb_scan_packet中检查过
+        nal_size = annexb_read_nal_size(buf, ctx->length_size);
+        buf += ctx->length_size;
 
-        len = fwrite( out->data, 1, out->size, dst_fd);
-        if(len != out->size){
-            av_log(NULL, AV_LOG_DEBUG, "warning, length of writed data isn't equal pkt.size(%d, %d)\n",
-                    len,
-                    out->size);
+        /* prepend only to the first IRAP NAL unit of the packet, if no parameter sets are already present */
+        if (insert_ps && !ps_written && nal_size && annexb_is_irap(ctx, annexb_nal_type(ctx, buf))) {
+            //多slice的IDR帧只在第一个slice之前加缓存的参数集
+            out = copy_with_startcode(out, ctx->ps, ctx->ps_size, buf, nal_size, 1);
+            ps_written = 1;
+        } else {
+            out = copy_with_startcode(out, NULL, 0, buf, nal_size, out == ctx->out);
         }
-        fflush(dst_fd);
-/**
- 不太懂
- */
-next_nal:
-        buf        += nal_size;
-        cumul_size += nal_size + 4;//s->length_size;
-    } while (cumul_size < buf_size);
-
-fail:
-    av_packet_free(&out);
+        buf += nal_size;
+    }
 
-    return ret;
+    //整个access unit一次写出，不再每个NAL都fwrite+fflush
+    return ctx->write_packet(ctx->opaque, ctx->out, out - ctx->out);
 }
 
 int main(int argc, char* argv[]) {
     AVFormatContext* fmt_ctx = NULL;
-    AVPacket* pkt;
+    AVPacket* pkt = NULL;
     FILE* file = NULL;
     char* in_file = NULL;
     char* out_file = NULL;
-    int ret, len;
+    FILE* index_file = NULL;
+    int ret, len, i, stream_index;
+    AnnexBContext annexb_ctx = { 0 };
+    AnnexBOutput output = { 0 };
+    int64_t frame_offset;
 
     av_log_set_level(AV_LOG_INFO);
     
@@ -270,20 +527,53 @@ int main(int argc, char* argv[]) {
     	av_log(NULL, AV_LOG_ERROR, "open %s failed!\n", out_file);
 	goto release;
     }
+    //每个packet一次fwrite，由较大的stdio缓冲区合并成大块写入
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    output.file = file;
 
     ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, -1);
     if (ret < 0) {
-	av_log(NULL, AV_LOG_ERROR, "find audio stream failed%s\n", av_err2str(ret));
+	av_log(NULL, AV_LOG_ERROR, "find video stream failed%s\n", av_err2str(ret));
+	goto release;
+    }
+    stream_index = ret;
+
+    //可选的第三个参数：帧索引文件，记录每个access unit在输出文件中的位置，方便随机访问
+    if (argc > 3 && !(index_file = es_index_open(argv[3], fmt_ctx->streams[stream_index]->time_base)))
+	goto release;
+
+    //参数集只从extradata解析一次，之后每个IDR/IRAP帧都使用缓存
+    if ((ret = annexb_init(&annexb_ctx, fmt_ctx->streams[stream_index]->codecpar,
+                           annexb_write_file, &output)) < 0) {
+	av_log(NULL, AV_LOG_ERROR, "parse parameter sets failed: %s\n", av_err2str(ret));
+	goto release;
     }
+
+    //其他流在demux时直接丢弃，libavformat不再为它们读数据和分配packet
+    for (i = 0; i < (int) fmt_ctx->nb_streams; i++) {
+        if (i != stream_index) {
+            fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
     pkt = av_packet_alloc();
 
     while (av_read_frame(fmt_ctx, pkt) >= 0) {
-    	if (pkt->stream_index == ret) {
-	    h264_mp4toannexb(fmt_ctx, pkt, file);
+    	if (pkt->stream_index == stream_index) {
+	    frame_offset = output.offset;
+	    if ((ret = annexb_export_packet(&annexb_ctx, pkt)) < 0)
+		av_log(NULL, AV_LOG_WARNING, "skip invalid video packet: %s\n", av_err2str(ret));
+	    else if (index_file && es_index_add(index_file, frame_offset, output.offset - frame_offset,
+	                                        annexb_ctx.vcl_type < 0 ? 0xff : annexb_ctx.vcl_type,
+	                                        pkt->flags & AV_PKT_FLAG_KEY ? ES_INDEX_FLAG_KEY : 0,
+	                                        pkt->pts, pkt->dts) < 0)
+		av_log(NULL, AV_LOG_WARNING, "write frame index failed\n");
 	}
+	av_packet_unref(pkt);
     }
 
 release:
+    annexb_uninit(&annexb_ctx);
     if (fmt_ctx) {
         avformat_close_input(&fmt_ctx);
     }
@@ -293,6 +583,12 @@ release:
     if (file) {
         fclose(file);
     }
+    if (index_file) {
+        //缓冲中最后的索引条目在fclose时才真正写出
+        if (fclose(index_file) != 0) {
+            av_log(NULL, AV_LOG_ERROR, "Frame index not fully written!\n");
+        }
+    }
     
     return 0;
 }
@@ -0,0 +1,224 @@
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+/*
+** Batched file writer for the decoders.
+**
+** Decoded data is staged in a buffer and handed to the file in multiples of
+** OUTPUT_SINK_BLOCK_SIZE with the stdio buffer disabled, so every flush is one
+** large write(2) instead of one stdio call per sample.
+** In async mode a writer thread writes the full blocks while the decoder keeps
+** filling the second staging buffer. Without POSIX threads (_WIN32) async falls back
+** to synchronous writes.
+**
+** usage: dst = output_sink_reserve(sink, size); fill dst; output_sink_commit(sink, size);
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <libavutil/mem.h>
+
+#if !defined(_WIN32)
+#   define OUTPUT_SINK_HAVE_THREADS 1
+#   include <pthread.h>
+#endif
+
+#define OUTPUT_SINK_BLOCK_SIZE (1 << 20)
+
+typedef struct OutputSink {
+    FILE *file;
+    //staging buffers, the decoder fills buf[cur] and the writer thread drains the other one
+    uint8_t *buf[2];
+    size_t buf_size[2];
+    size_t len;
+    int cur;
+    int error;
+
+    int async;
+#ifdef OUTPUT_SINK_HAVE_THREADS
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    //bytes of buf[!cur] not written yet, 0 when the writer thread is idle
+    size_t pending;
+    int quit;
+#endif
+} OutputSink;
+
+#ifdef OUTPUT_SINK_HAVE_THREADS
+static void *output_sink_thread(void *arg) {
+    OutputSink *sink = (OutputSink *) arg;
+    const uint8_t *data;
+    size_t size;
+
+    pthread_mutex_lock(&sink->mutex);
+    for (;;) {
+        while (!sink->pending && !sink->quit) {
+            pthread_cond_wait(&sink->cond, &sink->mutex);
+        }
+        if (!sink->pending) {
+            break;
+        }
+        data = sink->buf[!sink->cur];
+        size = sink->pending;
+        pthread_mutex_unlock(&sink->mutex);
+
+        size = size - fwrite(data, 1, size, sink->file);
+
+        pthread_mutex_lock(&sink->mutex);
+        if (size) {
+            sink->error = 1;
+        }
+        sink->pending = 0;
+        pthread_cond_broadcast(&sink->cond);
+    }
+    pthread_mutex_unlock(&sink->mutex);
+    return NULL;
+}
+#endif
+
+/*
+** file stays owned by the caller and must not have been written yet, its stdio buffer is turned off.
+** return: the sink or NULL on allocation failure. async falls back to synchronous writes
+** when the writer thread can not be started
+*/
+static inline OutputSink *output_sink_open(FILE *file, int async) {
+    OutputSink *sink;
+    int i;
+
+    if (!(sink = (OutputSink *) calloc(1, sizeof(OutputSink)))) {
+        return NULL;
+    }
+    sink->file = file;
+    //staging buffers hold a block plus the remainder of the previous flush
+    for (i = 0; i < 2; i++) {
+        sink->buf_size[i] = 2 * OUTPUT_SINK_BLOCK_SIZE;
+        if (!(sink->buf[i] = (uint8_t *) av_malloc(sink->buf_size[i]))) {
+            av_free(sink->buf[0]);
+            free(sink);
+            return NULL;
+        }
+    }
+    setvbuf(file, NULL, _IONBF, 0);
+
+#ifdef OUTPUT_SINK_HAVE_THREADS
+    if (async) {
+        pthread_mutex_init(&sink->mutex, NULL);
+        pthread_cond_init(&sink->cond, NULL);
+        if (pthread_create(&sink->thread, NULL, output_sink_thread, sink)) {
+            fprintf(stderr, "Failed to start output writer thread, writing synchronously\n");
+            pthread_cond_destroy(&sink->cond);
+            pthread_mutex_destroy(&sink->mutex);
+        } else {
+            sink->async = 1;
+        }
+    }
+#else
+    if (async) {
+        fprintf(stderr, "No writer thread on this platform, writing synchronously\n");
+    }
+#endif
+    return sink;
+}
+
+//writes the whole blocks staged so far, or everything when final is set
+static inline void output_sink_flush(OutputSink *sink, int final) {
+    size_t size = final ? sink->len : sink->len / OUTPUT_SINK_BLOCK_SIZE * OUTPUT_SINK_BLOCK_SIZE;
+    size_t remainder = sink->len - size;
+
+    if (!size) {
+        return;
+    }
+    if (!sink->async) {
+        if (fwrite(sink->buf[sink->cur], 1, size, sink->file) != size) {
+            sink->error = 1;
+        }
+        memmove(sink->buf[sink->cur], sink->buf[sink->cur] + size, remainder);
+        sink->len = remainder;
+        return;
+    }
+
+#ifdef OUTPUT_SINK_HAVE_THREADS
+    //等待写线程写完上一批数据，把整块交给写线程，剩余不足一块的数据移到另一个缓冲区继续填充
+    pthread_mutex_lock(&sink->mutex);
+    while (sink->pending) {
+        pthread_cond_wait(&sink->cond, &sink->mutex);
+    }
+    memcpy(sink->buf[!sink->cur], sink->buf[sink->cur] + size, remainder);
+    sink->pending = size;
+    sink->cur = !sink->cur;
+    sink->len = remainder;
+    pthread_cond_signal(&sink->cond);
+    pthread_mutex_unlock(&sink->mutex);
+#endif
+}
+
+//return: size bytes of contiguous staging space, NULL on allocation failure
+static inline uint8_t *output_sink_reserve(OutputSink *sink, size_t size) {
+    uint8_t *buf;
+
+    if (sink->len + size > sink->buf_size[sink->cur]) {
+        if (!(buf = (uint8_t *) av_realloc(sink->buf[sink->cur], sink->len + size))) {
+            return NULL;
+        }
+        sink->buf[sink->cur] = buf;
+        sink->buf_size[sink->cur] = sink->len + size;
+    }
+    return sink->buf[sink->cur] + sink->len;
+}
+
+//size: bytes filled in the space returned by output_sink_reserve
+static inline void output_sink_commit(OutputSink *sink, size_t size) {
+    sink->len += size;
+    if (sink->len >= OUTPUT_SINK_BLOCK_SIZE) {
+        output_sink_flush(sink, 0);
+    }
+}
+
+//return: succeed >= 0 or failed < 0
+static inline int output_sink_write(OutputSink *sink, const void *data, size_t size) {
+    uint8_t *dst;
+
+    if (!(dst = output_sink_reserve(sink, size))) {
+        return -1;
+    }
+    memcpy(dst, data, size);
+    output_sink_commit(sink, size);
+    return 0;
+}
+
+/*
+** writes the staged data, stops the writer thread and frees the sink, the file is not closed.
+** return: succeed >= 0 or failed < 0 (some data could not be written)
+*/
+static inline int output_sink_close(OutputSink **psink) {
+    OutputSink *sink = *psink;
+    int ret;
+
+    if (!sink) {
+        return 0;
+    }
+    output_sink_flush(sink, 1);
+#ifdef OUTPUT_SINK_HAVE_THREADS
+    if (sink->async) {
+        pthread_mutex_lock(&sink->mutex);
+        sink->quit = 1;
+        pthread_cond_signal(&sink->cond);
+        pthread_mutex_unlock(&sink->mutex);
+        pthread_join(sink->thread, NULL);
+        pthread_cond_destroy(&sink->cond);
+        pthread_mutex_destroy(&sink->mutex);
+    }
+#endif
+    ret = sink->error || fflush(sink->file) ? -1 : 0;
+
+    av_free(sink->buf[0]);
+    av_free(sink->buf[1]);
+    free(sink);
+    *psink = NULL;
+    return ret;
+}
+
+#endif
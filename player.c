@@ -1,9 +1,12 @@
 #include <stdio.h>
+#include <math.h>
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/avutil.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/cpu.h>
 #include <SDL2/SDL.h>
+#include "audio_interleave.h"
 
 #undef main
 #define WINDOW_DEFAULT_WIDTH 1920
@@ -13,34 +16,133 @@
 //Break
 #define BREAK_EVENT  (SDL_USEREVENT + 2)
 
-#define BUFFER_SIZE 4096000
+//音频环形缓冲区的大小，必须是2的幂，这样读写下标可以直接用 & mask 取模
+#define AUDIO_RING_SIZE (1 << 22)
+//缓冲区中的数据不多于BUFFER_REFRESH_SIZE时唤醒音频线程解码，一直填充到AUDIO_RING_SIZE - 2 * BUFFER_REFRESH_SIZE
 #define BUFFER_REFRESH_SIZE 51200
 
+//packet队列的容量，必须是2的幂，这样下标可以直接用 & mask 取模
+#define AUDIO_PACKET_QUEUE_SIZE 64
+#define VIDEO_PACKET_QUEUE_SIZE 64
+#define CACHE_LINE_SIZE 64
+//frame队列的容量以及解码线程开始等待的水位
+#define FRAME_QUEUE_SIZE 30
+#define FRAME_QUEUE_HIGH_WATER 25
+
+//音视频同步阈值(秒)，视频帧与音频主时钟的差值在阈值内视为同步
+#define AV_SYNC_THRESHOLD_MIN 0.04
+#define AV_SYNC_THRESHOLD_MAX 0.1
+//差值超过该值说明时间戳不连续，不再尝试同步
+#define AV_NOSYNC_THRESHOLD 10.0
+//两次刷新之间最长的等待时间，保证退出请求能及时被处理
+#define REFRESH_DELAY_MAX 0.1
+//解码线程每输出这么多帧评估一次是否需要调整解码器的跳过等级
+#define SKIP_WINDOW_FRAMES 30
+//窗口内迟到的帧超过这个比例时提高跳过等级，没有迟到的帧时降低一级
+#define SKIP_ESCALATE_RATIO 0.25
+
 static unsigned int pkt_num = 0;
 
-typedef struct AVPacketNode {
-    struct AVPacketNode *next;
-    AVPacket *pkt;
-} AVPacketNode;
-
-typedef struct LinkedListAVPacketQueue {
-    AVPacketNode *head;
-    AVPacketNode *tail;
-    AVPacketNode *node;
-    size_t count;
-    const size_t max_size;
+/*
+** Sleep/wakeup point shared by a producer and a consumer thread.
+** A thread that has to wait sleeps on cond until its condition becomes true;
+** the other side calls wake_thread_signal after changing the shared state.
+** The wake is free when nobody is waiting, waiters is only non zero while a thread
+** is blocked, so the mutex is never touched on the fast path.
+*/
+typedef struct ThreadSignal {
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    SDL_atomic_t waiters;
+    SDL_atomic_t abort_request;
+} ThreadSignal;
+
+/*
+** Single-producer/single-consumer packet ring.
+** The demux thread is the only writer of tail_index and the decoder thread is the
+** only writer of head_index, so no lock is needed. Packets are moved in and out of
+** the preallocated slots with av_packet_move_ref, the queue itself never allocates.
+** head_index and tail_index live on separate cache lines to avoid false sharing.
+*/
+typedef struct RingAVPacketQueue {
+    AVPacket **pkt_array;
+    unsigned int capacity;
+    unsigned int mask;
+    char pad0[CACHE_LINE_SIZE];
+    SDL_atomic_t head_index;
+    char pad1[CACHE_LINE_SIZE - sizeof(SDL_atomic_t)];
+    SDL_atomic_t tail_index;
+    char pad2[CACHE_LINE_SIZE - sizeof(SDL_atomic_t)];
+    //wakes the producer when a slot is freed and the consumer when a packet arrives
+    ThreadSignal signal;
 } AVPacketQueue;
 
+/*
+** Single-producer/single-consumer byte ring holding interleaved PCM.
+** refresh_audio_thread writes decoded samples at write_index, the SDL audio callback
+** reads them at read_index; each side only advances its own index, so no lock is needed
+** and no data is ever moved inside the buffer.
+*/
+typedef struct AudioRingBuffer {
+    Uint8 *data;
+    unsigned int size;
+    unsigned int mask;
+    char pad0[CACHE_LINE_SIZE];
+    SDL_atomic_t read_index;
+    char pad1[CACHE_LINE_SIZE - sizeof(SDL_atomic_t)];
+    SDL_atomic_t write_index;
+    char pad2[CACHE_LINE_SIZE - sizeof(SDL_atomic_t)];
+} AudioRingBuffer;
+
+/*
+** Single-producer/single-consumer frame ring that doubles as a frame pool.
+** The AVFrames are allocated once; the decoder moves decoded frames into them with
+** av_frame_move_ref and the render loop unrefs them after display, so the frame
+** structs themselves are never reallocated.
+*/
 typedef struct ArrayAVFrameQueue {
-    AVFrame *frame_array[30];
+    AVFrame *frame_array[FRAME_QUEUE_SIZE];
     unsigned int head_index;
     unsigned int tail_index;
-    size_t count;
+    SDL_atomic_t count;
+    //wakes the decoder when the render loop has consumed a frame
+    ThreadSignal signal;
 } AVFrameQueue;
 
+/*
+** Decoder threading selected by init_codec_context.
+** CODEC_THREAD_AUTO picks frame threading when the decoder supports it (falling back to
+** slice threading) for video, and a single thread for audio where threading does not pay off.
+*/
+enum CodecThreadMode {
+    CODEC_THREAD_AUTO,
+    CODEC_THREAD_FRAME,
+    CODEC_THREAD_SLICE,
+};
+
+typedef struct CodecOptions {
+    enum CodecThreadMode thread_mode;
+    //0 means one thread per core
+    int thread_count;
+} CodecOptions;
+
+/*
+** Decoder skip levels used under sustained lag, from cheapest to most aggressive:
+** first the deblocking filter is skipped, then non-reference frames, then everything but keyframes
+*/
+static const struct {
+    enum AVDiscard skip_loop_filter;
+    enum AVDiscard skip_frame;
+} decoder_skip_levels[] = {
+    { AVDISCARD_DEFAULT, AVDISCARD_DEFAULT },
+    { AVDISCARD_NONREF,  AVDISCARD_DEFAULT },
+    { AVDISCARD_ALL,     AVDISCARD_DEFAULT },
+    { AVDISCARD_ALL,     AVDISCARD_NONREF  },
+    { AVDISCARD_ALL,     AVDISCARD_NONKEY  },
+};
+
 typedef struct AudioAndVideoContext {
     char *file_name;
-    double delay_mills;
 
     //audio parameters
     int audio_stream_index;
@@ -48,9 +150,43 @@ typedef struct AudioAndVideoContext {
     int sample_rate;
     AVCodecContext *acodec_ctx;
     AVPacketQueue *audio_queue;
-    Uint8* audio_buffer;
-    Uint8* audio_position;
-    size_t audio_buffer_len;
+    AudioRingBuffer *audio_ring;
+    //wakes the audio refresh thread when the ring drops below BUFFER_REFRESH_SIZE,
+    //or when audio_space_wanted bytes became free
+    ThreadSignal audio_signal;
+    SDL_atomic_t audio_space_wanted;
+
+    //clock parameters, audio is the master clock
+    AVRational audio_time_base;
+    AVRational video_time_base;
+    int audio_bytes_per_sec;
+    //pts in seconds of the data at audio_ring->write_index, written by the audio refresh thread
+    double audio_clock;
+    //pts in seconds of the sample the sound card started playing in the last callback
+    double audio_callback_clock;
+    double audio_callback_period;
+    Uint64 audio_callback_time;
+    //keeps audio_clock consistent with audio_ring->write_index and guards the callback clock fields
+    SDL_SpinLock audio_lock;
+    //refresh_video_thread sleeps refresh_delay_ms after the render loop posted refresh_sem
+    SDL_sem *refresh_sem;
+    SDL_atomic_t refresh_delay_ms;
+
+    //sync statistics, only touched by the render loop
+    double av_diff;
+    unsigned int frames_displayed;
+    unsigned int frames_dropped;
+    unsigned int frames_repeated;
+
+    //adaptive mode: drop late frames in the decoder and escalate decoder skip levels under lag
+    int framedrop;
+    //decoder side state, only touched by decode_video_thread
+    int skip_level;
+    int window_frames;
+    int window_late;
+    //read by the render loop for the status line
+    SDL_atomic_t decoder_frames_dropped;
+    SDL_atomic_t decoder_skip_level;
 
     //video parameters
     int video_stream_index;
@@ -59,78 +195,416 @@ typedef struct AudioAndVideoContext {
     double frame_rate;
     AVCodecContext *vcodec_ctx;
     enum AVPixelFormat pix_fmt;
-    uint8_t *video_dst_data[4];
-    int video_dst_linesize[4];
-    int video_dst_bufsize;
     AVFrameQueue *frame_queue;
     AVPacketQueue *video_queue;
 
+    //set by the demux thread once the decoders are open (1) or could not be opened (-1),
+    //main creates the texture and the refresh threads only after that
+    SDL_atomic_t streams_ready;
+    ThreadSignal streams_signal;
+
     int quit;
 } AudioVideoContext;
 
-static int getCount(AVPacketQueue *queue) {
-    return queue->count;
+static int init_thread_signal(ThreadSignal *signal) {
+    if (!(signal->mutex = SDL_CreateMutex())) {
+        fprintf(stderr, "Failed to create mutex: %s\n", SDL_GetError());
+        return -1;
+    }
+    if (!(signal->cond = SDL_CreateCond())) {
+        fprintf(stderr, "Failed to create cond: %s\n", SDL_GetError());
+        SDL_DestroyMutex(signal->mutex);
+        return -1;
+    }
+    SDL_AtomicSet(&signal->waiters, 0);
+    SDL_AtomicSet(&signal->abort_request, 0);
+    return 0;
 }
 
-static AVPacketNode* peek_node(AVPacketQueue *queue) {
-    if (!queue || queue->count == 0) {
-        return NULL;
+static void destroy_thread_signal(ThreadSignal *signal) {
+    if (signal->cond) {
+        SDL_DestroyCond(signal->cond);
+    }
+    if (signal->mutex) {
+        SDL_DestroyMutex(signal->mutex);
     }
-    return queue->head;
 }
 
-static AVPacketNode* remove_node(AVPacketQueue *queue) {
-    if (!queue || queue->count == 0) {
+//call after the shared state has been changed
+static void wake_thread_signal(ThreadSignal *signal) {
+    if (SDL_AtomicGet(&signal->waiters) > 0) {
+        SDL_LockMutex(signal->mutex);
+        SDL_CondBroadcast(signal->cond);
+        SDL_UnlockMutex(signal->mutex);
+    }
+}
+
+//wakes every waiter and makes all further waits fail
+static void abort_thread_signal(ThreadSignal *signal) {
+    SDL_AtomicSet(&signal->abort_request, 1);
+    SDL_LockMutex(signal->mutex);
+    SDL_CondBroadcast(signal->cond);
+    SDL_UnlockMutex(signal->mutex);
+}
+
+//blocks until ready(opaque) returns non zero
+//return: succeed >= 0 or failed < 0 (the signal was aborted)
+static int wait_thread_signal(ThreadSignal *signal, int (*ready)(void *opaque), void *opaque) {
+    int ret = 0;
+    if (ready(opaque)) {
+        return 0;
+    }
+    SDL_LockMutex(signal->mutex);
+    //waiters is raised before ready() is checked again, so a wake that races with us
+    //either sees the waiter or we see its state change
+    SDL_AtomicIncRef(&signal->waiters);
+    while (!ready(opaque)) {
+        if (SDL_AtomicGet(&signal->abort_request)) {
+            ret = -1;
+            break;
+        }
+        SDL_CondWait(signal->cond, signal->mutex);
+    }
+    SDL_AtomicDecRef(&signal->waiters);
+    SDL_UnlockMutex(signal->mutex);
+    return ret;
+}
+
+static AVPacketQueue* alloc_packet_queue(unsigned int capacity) {
+    AVPacketQueue *queue;
+    unsigned int i;
+
+    //capacity must be a power of two
+    if (capacity == 0 || (capacity & (capacity - 1))) {
+        fprintf(stderr, "packet queue capacity %u is not a power of two\n", capacity);
         return NULL;
     }
-    AVPacketNode *top = queue->head;
-    queue->head = top->next;
-    queue->count--;
-    return top;
+    if (!(queue = (AVPacketQueue *) calloc(1, sizeof(AVPacketQueue)))) {
+        return NULL;
+    }
+    if (!(queue->pkt_array = (AVPacket **) calloc(capacity, sizeof(AVPacket *)))) {
+        free(queue);
+        return NULL;
+    }
+    for (i = 0; i < capacity; i++) {
+        if (!(queue->pkt_array[i] = av_packet_alloc())) {
+            goto fail;
+        }
+    }
+    if (init_thread_signal(&queue->signal) < 0) {
+        goto fail;
+    }
+    queue->capacity = capacity;
+    queue->mask = capacity - 1;
+    SDL_AtomicSet(&queue->head_index, 0);
+    SDL_AtomicSet(&queue->tail_index, 0);
+    return queue;
+
+fail:
+    for (i = 0; i < capacity; i++) {
+        av_packet_free(&queue->pkt_array[i]);
+    }
+    free(queue->pkt_array);
+    free(queue);
+    return NULL;
 }
 
-//return: succeed >= 0 or failed < 0
-int add_node(AVPacketQueue *queue, AVPacket *pkt) {
+static void free_packet_queue(AVPacketQueue *queue) {
+    unsigned int i;
+    if (!queue) {
+        return;
+    }
+    //av_packet_free also unrefs packets that were never consumed
+    for (i = 0; i < queue->capacity; i++) {
+        av_packet_free(&queue->pkt_array[i]);
+    }
+    free(queue->pkt_array);
+    destroy_thread_signal(&queue->signal);
+    free(queue);
+}
+
+static unsigned int getCount(AVPacketQueue *queue) {
+    //indices run freely and wrap around, the difference is still the element count
+    return (unsigned int) SDL_AtomicGet(&queue->tail_index) - (unsigned int) SDL_AtomicGet(&queue->head_index);
+}
+
+//producer side. takes ownership of pkt's data, pkt is blank afterwards
+//return: succeed >= 0 or failed < 0 (queue is full)
+static int put_packet(AVPacketQueue *queue, AVPacket *pkt) {
+    unsigned int head, tail;
     if (!queue) {
         return -1;
     }
-    AVPacketNode *node = (AVPacketNode *) malloc(sizeof(AVPacketNode));
-    node->pkt = pkt;
-    node->next = NULL;
-    if (queue->count == 0) {
-        queue->head = node;
-        queue->tail = node;
-    } else {
-        queue->tail->next = node;
-        queue->tail = node;
+    tail = (unsigned int) SDL_AtomicGet(&queue->tail_index);
+    head = (unsigned int) SDL_AtomicGet(&queue->head_index);
+    if (tail - head >= queue->capacity) {
+        return -1;
+    }
+    av_packet_move_ref(queue->pkt_array[tail & queue->mask], pkt);
+    //publish the slot only after it has been filled
+    SDL_AtomicSet(&queue->tail_index, (int) (tail + 1));
+    wake_thread_signal(&queue->signal);
+    return 0;
+}
+
+//consumer side. moves the oldest packet into pkt, which must be blank
+//return: succeed >= 0 or failed < 0 (queue is empty)
+static int get_packet(AVPacketQueue *queue, AVPacket *pkt) {
+    unsigned int head, tail;
+    if (!queue) {
+        return -1;
+    }
+    head = (unsigned int) SDL_AtomicGet(&queue->head_index);
+    tail = (unsigned int) SDL_AtomicGet(&queue->tail_index);
+    if (head == tail) {
+        return -1;
     }
-    queue->count++;
+    av_packet_move_ref(pkt, queue->pkt_array[head & queue->mask]);
+    //hand the slot back to the producer only after it has been emptied
+    SDL_AtomicSet(&queue->head_index, (int) (head + 1));
+    wake_thread_signal(&queue->signal);
     return 0;
 }
 
+static int packet_queue_has_space(void *opaque) {
+    AVPacketQueue *queue = (AVPacketQueue *) opaque;
+    return getCount(queue) < queue->capacity;
+}
+
+static int packet_queue_has_data(void *opaque) {
+    return getCount((AVPacketQueue *) opaque) > 0;
+}
+
+//same as put_packet, but sleeps while the queue is full
+//return: succeed >= 0 or failed < 0 (the queue was aborted)
+static int put_packet_wait(AVPacketQueue *queue, AVPacket *pkt) {
+    while (put_packet(queue, pkt) < 0) {
+        if (wait_thread_signal(&queue->signal, packet_queue_has_space, queue) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//same as get_packet, but sleeps while the queue is empty
+//return: succeed >= 0 or failed < 0 (the queue was aborted)
+static int get_packet_wait(AVPacketQueue *queue, AVPacket *pkt) {
+    while (get_packet(queue, pkt) < 0) {
+        if (wait_thread_signal(&queue->signal, packet_queue_has_data, queue) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int frame_queue_has_space(void *opaque) {
+    return SDL_AtomicGet(&((AVFrameQueue *) opaque)->count) <= FRAME_QUEUE_HIGH_WATER;
+}
+
+static int frame_queue_not_full(void *opaque) {
+    return SDL_AtomicGet(&((AVFrameQueue *) opaque)->count) < FRAME_QUEUE_SIZE;
+}
+
+static AVFrameQueue* alloc_frame_queue() {
+    AVFrameQueue *queue;
+    int i;
+    if (!(queue = (AVFrameQueue *) calloc(1, sizeof(AVFrameQueue)))) {
+        return NULL;
+    }
+    for (i = 0; i < FRAME_QUEUE_SIZE; i++) {
+        if (!(queue->frame_array[i] = av_frame_alloc())) {
+            goto fail;
+        }
+    }
+    if (init_thread_signal(&queue->signal) < 0) {
+        goto fail;
+    }
+    SDL_AtomicSet(&queue->count, 0);
+    queue->head_index = 0;
+    queue->tail_index = 0;
+    return queue;
+
+fail:
+    for (i = 0; i < FRAME_QUEUE_SIZE; i++) {
+        av_frame_free(&queue->frame_array[i]);
+    }
+    free(queue);
+    return NULL;
+}
+
+static void free_frame_queue(AVFrameQueue *queue) {
+    int i;
+    if (!queue) {
+        return;
+    }
+    for (i = 0; i < FRAME_QUEUE_SIZE; i++) {
+        av_frame_free(&queue->frame_array[i]);
+    }
+    destroy_thread_signal(&queue->signal);
+    free(queue);
+}
+
+//producer side, the caller must have waited for frame_queue_not_full.
+//takes ownership of src's buffers, src is blank afterwards
+static void push_frame(AVFrameQueue *queue, AVFrame *src) {
+    av_frame_move_ref(queue->frame_array[queue->tail_index], src);
+    queue->tail_index = (queue->tail_index + 1) % FRAME_QUEUE_SIZE;
+    SDL_AtomicIncRef(&queue->count);
+}
+
+//consumer side. the returned frame stays valid until pop_frame
+static AVFrame* peek_frame(AVFrameQueue *queue) {
+    if (SDL_AtomicGet(&queue->count) <= 0) {
+        return NULL;
+    }
+    return queue->frame_array[queue->head_index];
+}
+
+//consumer side. releases the buffers of the head frame and hands the slot back
+static void pop_frame(AVFrameQueue *queue) {
+    av_frame_unref(queue->frame_array[queue->head_index]);
+    queue->head_index = (queue->head_index + 1) % FRAME_QUEUE_SIZE;
+    SDL_AtomicAdd(&queue->count, -1);
+    wake_thread_signal(&queue->signal);
+}
+
+static AudioRingBuffer* alloc_audio_ring(unsigned int size) {
+    AudioRingBuffer *ring;
+    if (size == 0 || (size & (size - 1))) {
+        fprintf(stderr, "audio ring size %u is not a power of two\n", size);
+        return NULL;
+    }
+    if (!(ring = (AudioRingBuffer *) calloc(1, sizeof(AudioRingBuffer)))) {
+        return NULL;
+    }
+    if (!(ring->data = (Uint8 *) malloc(size))) {
+        free(ring);
+        return NULL;
+    }
+    ring->size = size;
+    ring->mask = size - 1;
+    SDL_AtomicSet(&ring->read_index, 0);
+    SDL_AtomicSet(&ring->write_index, 0);
+    return ring;
+}
+
+static void free_audio_ring(AudioRingBuffer *ring) {
+    if (!ring) {
+        return;
+    }
+    free(ring->data);
+    free(ring);
+}
+
+//bytes written but not read yet
+static unsigned int audio_ring_count(AudioRingBuffer *ring) {
+    return (unsigned int) SDL_AtomicGet(&ring->write_index) - (unsigned int) SDL_AtomicGet(&ring->read_index);
+}
+
+static unsigned int audio_ring_space(AudioRingBuffer *ring) {
+    return ring->size - audio_ring_count(ring);
+}
+
+//consumer side. mixes up to len bytes into stream, split in two when the data wraps around
+//return: the number of bytes consumed
+static unsigned int audio_ring_mix(AudioRingBuffer *ring, Uint8 *stream, unsigned int len) {
+    unsigned int read = (unsigned int) SDL_AtomicGet(&ring->read_index);
+    unsigned int offset = read & ring->mask;
+    unsigned int first;
+
+    len = SDL_min(len, audio_ring_count(ring));
+    first = SDL_min(len, ring->size - offset);
+    SDL_MixAudio(stream, ring->data + offset, first, SDL_MIX_MAXVOLUME);
+    if (len > first) {
+        SDL_MixAudio(stream + first, ring->data, len - first, SDL_MIX_MAXVOLUME);
+    }
+    //hand the bytes back to the writer only after they have been read
+    SDL_AtomicSet(&ring->read_index, (int) (read + len));
+    return len;
+}
+
+static int audio_ring_needs_refill(void *opaque) {
+    return audio_ring_count(((AudioVideoContext *) opaque)->audio_ring) <= BUFFER_REFRESH_SIZE;
+}
+
+static int audio_ring_has_wanted_space(void *opaque) {
+    AudioVideoContext *avctx = (AudioVideoContext *) opaque;
+    return audio_ring_space(avctx->audio_ring) >= (unsigned int) SDL_AtomicGet(&avctx->audio_space_wanted);
+}
+
+//return: succeed >= 0 or failed < 0 (the audio thread was aborted)
+static int write_audio_frame(AudioVideoContext* avctx, const AVFrame *frame, int data_size) {
+    AudioRingBuffer *ring = avctx->audio_ring;
+    unsigned int write, offset, frame_size, sample_size, tail;
+    int i, ch, head_samples, channels = avctx->acodec_ctx->ch_layout.nb_channels;
+    int planar = av_sample_fmt_is_planar(frame->format);
+
+    sample_size = channels * data_size;
+    frame_size = frame->nb_samples * sample_size;
+    if (frame_size > ring->size) {
+        fprintf(stderr, "audio frame of %u bytes does not fit into the audio ring\n", frame_size);
+        return 0;
+    }
+    //环形缓冲区剩余空间不足时，睡眠到声卡回调释放出足够的空间
+    if (audio_ring_space(ring) < frame_size) {
+        SDL_AtomicSet(&avctx->audio_space_wanted, (int) frame_size);
+        if (wait_thread_signal(&avctx->audio_signal, audio_ring_has_wanted_space, avctx) < 0) {
+            return -1;
+        }
+        SDL_AtomicSet(&avctx->audio_space_wanted, 0);
+    }
+
+    //直接交错写入环形缓冲区，到缓冲区末尾为止的整样本一次转换，剩下的从缓冲区头部继续
+    write = (unsigned int) SDL_AtomicGet(&ring->write_index);
+    offset = write & ring->mask;
+    tail = ring->size - offset;
+    head_samples = FFMIN(frame->nb_samples, (int) (tail / sample_size));
+    interleave_audio_frame(ring->data + offset, frame, 0, head_samples);
+    if (head_samples == frame->nb_samples) {
+        return (int) frame_size;
+    }
+
+    //5.1这类样本大小不是2的幂时，会有一个样本跨越缓冲区末尾，逐字节写入
+    offset = write + head_samples * sample_size;
+    if (tail % sample_size) {
+        for (ch = 0; ch < channels; ch++) {
+            const uint8_t *src = planar ? frame->extended_data[ch] + head_samples * data_size :
+                frame->extended_data[0] + (head_samples * channels + ch) * data_size;
+            for (i = 0; i < data_size; i++) {
+                ring->data[offset++ & ring->mask] = src[i];
+            }
+        }
+        head_samples++;
+    }
+    interleave_audio_frame(ring->data + (offset & ring->mask), frame, head_samples,
+                           frame->nb_samples - head_samples);
+    return (int) frame_size;
+}
+
 void decode_audio(AudioVideoContext* avctx) {
     AVFrame *frame;
-    Uint8 *temp_buffer;
-	int i, ch, ret, data_size, temp_buffer_len;
-
-    //将未播放的音频数据从audio_buffer尾部移至头部
-    memmove(avctx->audio_buffer, avctx->audio_position, avctx->audio_buffer_len);
-    avctx->audio_position = avctx->audio_buffer;
+    AVPacket *pkt;
+	int ret, data_size, written;
+    unsigned int decoded = 0;
+    double clock = avctx->audio_clock;
 
     if (!(frame = av_frame_alloc())) {
         fprintf(stderr, "Failed to alloc AVFrame when decode audio\n");
         return;
     }
 
-    temp_buffer = (Uint8 *) malloc(BUFFER_SIZE - BUFFER_REFRESH_SIZE);
-    temp_buffer_len = 0;
-
-    //解码BUFFER_SIZE - 2 * BUFFER_REFRESH_SIZE长度的音频数据放入temp_buffer_len中
-    while (temp_buffer_len < BUFFER_SIZE - 2 * BUFFER_REFRESH_SIZE && avctx->audio_queue->count > 0) {
-        //从音频packet队列中取出一个packet
-        AVPacketNode *node = remove_node(avctx->audio_queue);
+    if (!(pkt = av_packet_alloc())) {
+        fprintf(stderr, "Failed to alloc AVPacket when decode audio\n");
+        av_frame_free(&frame);
+        return;
+    }
 
-        ret = avcodec_send_packet(avctx->acodec_ctx, node->pkt);
+    //解码音频数据直到环形缓冲区中有AUDIO_RING_SIZE - 2 * BUFFER_REFRESH_SIZE长度的数据
+    //从音频packet队列中取出一个packet，本轮还没有解出数据时阻塞等待demux线程
+    while (audio_ring_count(avctx->audio_ring) < AUDIO_RING_SIZE - 2 * BUFFER_REFRESH_SIZE &&
+           (decoded == 0 ? get_packet_wait(avctx->audio_queue, pkt) : get_packet(avctx->audio_queue, pkt)) >= 0) {
+        ret = avcodec_send_packet(avctx->acodec_ctx, pkt);
+        av_packet_unref(pkt);
         if (ret < 0) {
             printf("Failed to send packet: %s\n", av_err2str(ret));
             exit(1);
@@ -151,74 +625,248 @@ void decode_audio(AudioVideoContext* avctx) {
                 exit(1);
             }
 
-            for (int i = 0; i < frame->nb_samples; i++) {
-                for (int ch = 0; ch < avctx->acodec_ctx->ch_layout.nb_channels; ch++) {
-                    memmove(temp_buffer + temp_buffer_len, frame->data[ch] + data_size*i, data_size);
-                    temp_buffer_len += data_size;
-                }
+            if ((written = write_audio_frame(avctx, frame, data_size)) < 0) {
+                goto end;
+            }
+            decoded += written;
+
+            //音频时钟为已解码数据末尾的pts
+            if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+                clock = frame->best_effort_timestamp * av_q2d(avctx->audio_time_base);
             }
+            clock += (double) frame->nb_samples / frame->sample_rate;
+
+            //数据写完后再发布写下标，和音频时钟一起更新，声卡回调看到的两者总是一致的
+            SDL_AtomicLock(&avctx->audio_lock);
+            SDL_AtomicSet(&avctx->audio_ring->write_index,
+                          SDL_AtomicGet(&avctx->audio_ring->write_index) + written);
+            avctx->audio_clock = clock;
+            SDL_AtomicUnlock(&avctx->audio_lock);
         }
+    }
+
+end:
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+}
 
-        av_packet_free(&node->pkt);
-        free(node);
+/*
+** return: the pts in seconds of the sample the user hears now, NAN before playback started.
+** the clock of the last callback is advanced by the time elapsed since, but by no more
+** than one callback period so that it stops when the audio underruns
+*/
+static double get_audio_clock(AudioVideoContext *avctx) {
+    double clock, period, elapsed;
+    Uint64 time;
+
+    SDL_AtomicLock(&avctx->audio_lock);
+    clock = avctx->audio_callback_clock;
+    period = avctx->audio_callback_period;
+    time = avctx->audio_callback_time;
+    SDL_AtomicUnlock(&avctx->audio_lock);
+
+    if (isnan(clock)) {
+        return NAN;
+    }
+    elapsed = (double) (SDL_GetPerformanceCounter() - time) / SDL_GetPerformanceFrequency();
+    return clock + FFMIN(elapsed, period);
+}
+
+static double get_frame_pts(AudioVideoContext *avctx, const AVFrame *frame) {
+    if (frame->best_effort_timestamp == AV_NOPTS_VALUE) {
+        return NAN;
     }
+    return frame->best_effort_timestamp * av_q2d(avctx->video_time_base);
+}
 
-    //将temp_buffer暂存区中的数据放入audio_buffer音频缓冲区
-    if (temp_buffer) {
-        if (temp_buffer_len <= 0) {
-            fprintf(stderr, "the strlen(buffer) <= 0\n");
-            return;
+static double get_frame_duration(AudioVideoContext *avctx, const AVFrame *frame) {
+    if (frame->duration > 0) {
+        return frame->duration * av_q2d(avctx->video_time_base);
+    }
+    return avctx->frame_rate > 0 ? 1.0 / avctx->frame_rate : 0.04;
+}
+
+/*
+** Decides which frame the render loop shows on this refresh, comparing frame pts
+** with the audio master clock:
+**   late  - the frame is dropped if a newer one is already decoded
+**   early - nothing is shown, the previous picture is repeated until the frame is due
+**   due   - the frame is shown
+** return: the frame to display (the caller pops it after upload) or NULL to repeat.
+** *delay is set to the time in seconds until the next refresh is needed
+*/
+static AVFrame* sync_video_frame(AudioVideoContext *avctx, double *delay) {
+    AVFrame *frame;
+    double pts, duration, master, diff, threshold;
+
+    while ((frame = peek_frame(avctx->frame_queue))) {
+        pts = get_frame_pts(avctx, frame);
+        duration = get_frame_duration(avctx, frame);
+        master = get_audio_clock(avctx);
+        *delay = duration;
+
+        //no audio clock yet or no timestamps: show frames at the nominal frame rate
+        if (isnan(pts) || isnan(master)) {
+            return frame;
+        }
+        diff = pts - master;
+        avctx->av_diff = diff;
+        if (fabs(diff) > AV_NOSYNC_THRESHOLD) {
+            return frame;
         }
 
-        memmove(avctx->audio_buffer + avctx->audio_buffer_len, temp_buffer, temp_buffer_len);
-        avctx->audio_buffer_len += temp_buffer_len;
+        threshold = FFMAX(AV_SYNC_THRESHOLD_MIN, FFMIN(AV_SYNC_THRESHOLD_MAX, duration));
+        if (diff < -threshold && SDL_AtomicGet(&avctx->frame_queue->count) > 1) {
+            avctx->frames_dropped++;
+            pop_frame(avctx->frame_queue);
+            continue;
+        }
+        if (diff > threshold) {
+            avctx->frames_repeated++;
+            *delay = diff;
+            return NULL;
+        }
+        //the next frame is due one frame duration after this one
+        *delay = FFMAX(0.0, diff + duration);
+        return frame;
     }
 
-    av_frame_free(&frame);
-    free(temp_buffer);
+    //the decoder is behind, look again soon
+    *delay = AV_SYNC_THRESHOLD_MIN / 2;
+    return NULL;
+}
+
+//return: non zero if the decoded frame is already late against the audio master clock
+static int is_frame_late(AudioVideoContext *avctx, const AVFrame *frame) {
+    double pts, duration, master, diff;
+
+    pts = get_frame_pts(avctx, frame);
+    master = get_audio_clock(avctx);
+    if (isnan(pts) || isnan(master)) {
+        return 0;
+    }
+    duration = get_frame_duration(avctx, frame);
+    diff = pts - master;
+    return fabs(diff) < AV_NOSYNC_THRESHOLD &&
+           diff < -FFMAX(AV_SYNC_THRESHOLD_MIN, FFMIN(AV_SYNC_THRESHOLD_MAX, duration));
 }
 
-static void decode_video(AudioVideoContext *avctx, AVPacket *pkt)
+/*
+** Counts late frames over windows of SKIP_WINDOW_FRAMES decoded frames. A window with
+** too many late frames raises the skip level of vcodec_ctx one step, a window without
+** any lowers it one step, so the decoder degrades gracefully and recovers when it can.
+*/
+static void update_decoder_skip(AudioVideoContext *avctx, int late) {
+    int level = avctx->skip_level;
+
+    avctx->window_frames++;
+    avctx->window_late += late;
+    if (avctx->window_frames < SKIP_WINDOW_FRAMES) {
+        return;
+    }
+
+    if (avctx->window_late >= SKIP_WINDOW_FRAMES * SKIP_ESCALATE_RATIO) {
+        level = FFMIN(level + 1, (int) FF_ARRAY_ELEMS(decoder_skip_levels) - 1);
+    } else if (avctx->window_late == 0) {
+        level = FFMAX(level - 1, 0);
+    }
+    avctx->window_frames = 0;
+    avctx->window_late = 0;
+
+    if (level != avctx->skip_level) {
+        //the decoder picks the new values up with the next packet, also in frame threading mode
+        avctx->vcodec_ctx->skip_loop_filter = decoder_skip_levels[level].skip_loop_filter;
+        avctx->vcodec_ctx->skip_frame = decoder_skip_levels[level].skip_frame;
+        avctx->skip_level = level;
+        SDL_AtomicSet(&avctx->decoder_skip_level, level);
+    }
+}
+
+//a blank packet (data == NULL, size == 0) flushes the decoder.
+//frame is a scratch frame owned by the caller, it is blank again on return
+//return: succeed >= 0 or failed < 0 (the frame queue was aborted)
+static int decode_video(AudioVideoContext *avctx, AVPacket *pkt, AVFrame *frame)
 {
     int ret;
-    //fprintf(stderr, "the count is %d\n", avctx->frame_queue->count);
-    if (avctx->frame_queue->count <= 25 /*&& avctx->video_queue->count > 1*/) {
-        AVPacket *packet = pkt;//remove_node(avctx->video_queue)->pkt;
-        ret = avcodec_send_packet(avctx->vcodec_ctx, packet);
-        if (ret < 0) {
-            fprintf(stderr, "Error sending a packet for decoding: %s\n", av_err2str(ret));
+    ret = avcodec_send_packet(avctx->vcodec_ctx, pkt);
+    if (ret < 0) {
+        fprintf(stderr, "Error sending a packet for decoding: %s\n", av_err2str(ret));
+        exit(1);
+    }
+
+    while (ret >= 0) {
+        ret = avcodec_receive_frame(avctx->vcodec_ctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return 0;
+        } else if (ret < 0) {
+            fprintf(stderr, "Error during decoding\n");
             exit(1);
         }
-        
-        while (ret >= 0) {
-            AVFrame *frame = av_frame_alloc();
-            ret = avcodec_receive_frame(avctx->vcodec_ctx, frame);
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                //av_frame_free(&frame);
-                return;
-            } else if (ret < 0) {
-                fprintf(stderr, "Error during decoding\n");
-                exit(1);
+        //已经落后于音频时钟的帧不进入frame队列，直接丢弃，避免渲染循环越来越落后
+        if (avctx->framedrop) {
+            int late = is_frame_late(avctx, frame);
+            update_decoder_skip(avctx, late);
+            if (late) {
+                SDL_AtomicIncRef(&avctx->decoder_frames_dropped);
+                av_frame_unref(frame);
+                continue;
             }
-            //fprintf(stderr, "the avctx->frame_queue->tail_index is %d\n", avctx->frame_queue->tail_index);
-            avctx->frame_queue->frame_array[avctx->frame_queue->tail_index] = frame;
-            avctx->frame_queue->count++;
-            avctx->frame_queue->tail_index = (avctx->frame_queue->tail_index + 1) % 30;
         }
-        
-        //av_packet_free(&packet);
+        //一个packet可能解出多帧(例如flush时)，队列满时等待渲染循环取走一帧
+        if (wait_thread_signal(&avctx->frame_queue->signal, frame_queue_not_full, avctx->frame_queue) < 0) {
+            av_frame_unref(frame);
+            return -1;
+        }
+        push_frame(avctx->frame_queue, frame);
     }
-    /*if (avctx->video_queue->count > 25) {
-        //wait for other thread wake
-        SDL_Delay(16.67);
-    }*/
-    //add_node(avctx->video_queue, pkt);
+    return 0;
+}
+
+static const char* get_thread_type_name(int thread_type) {
+    if (thread_type & FF_THREAD_FRAME) {
+        return "frame";
+    } else if (thread_type & FF_THREAD_SLICE) {
+        return "slice";
+    }
+    return "none";
+}
+
+//must be called before avcodec_open2
+static void set_codec_threading(AVCodecContext *codec_ctx, const AVCodec *decodec, const CodecOptions *opts) {
+    int caps = decodec->capabilities;
+    int thread_count = opts->thread_count > 0 ? opts->thread_count : FFMIN(av_cpu_count(), 16);
+    int thread_type = 0;
+
+    switch (opts->thread_mode) {
+    case CODEC_THREAD_FRAME:
+        thread_type = FF_THREAD_FRAME;
+        break;
+    case CODEC_THREAD_SLICE:
+        thread_type = FF_THREAD_SLICE;
+        break;
+    default:
+        if (codec_ctx->codec_type != AVMEDIA_TYPE_VIDEO) {
+            thread_count = 1;
+        }
+        thread_type = (caps & AV_CODEC_CAP_FRAME_THREADS) ? FF_THREAD_FRAME : FF_THREAD_SLICE;
+        break;
+    }
+
+    if ((thread_type == FF_THREAD_FRAME && !(caps & AV_CODEC_CAP_FRAME_THREADS)) ||
+        (thread_type == FF_THREAD_SLICE && !(caps & AV_CODEC_CAP_SLICE_THREADS))) {
+        fprintf(stderr, "Warning: %s decoder does not support %s threading\n",
+                decodec->name, get_thread_type_name(thread_type));
+    }
+
+    codec_ctx->thread_count = thread_count;
+    codec_ctx->thread_type = thread_type;
 }
 
 /*
 ** return: Returns the stream index of the lookup type
+** opts selects the decoder threading, NULL keeps the libavcodec defaults
 */
-int init_codec_context(AVCodecContext **codec_ctx, AVFormatContext *fmt_ctx, enum AVMediaType type) {
+int init_codec_context(AVCodecContext **codec_ctx, AVFormatContext *fmt_ctx, enum AVMediaType type, const CodecOptions *opts) {
     const AVStream *stream;
     const AVCodec *decodec;
     int ret = -1, stream_index = -1;
@@ -240,22 +888,84 @@ int init_codec_context(AVCodecContext **codec_ctx, AVFormatContext *fmt_ctx, enu
         fprintf(stderr, "Failed to get %s parameters from input AVFormatContext\n", av_get_media_type_string(type));
         return ret;
     }
+    if (opts) {
+        set_codec_threading(*codec_ctx, decodec, opts);
+    }
     if ((ret = avcodec_open2(*codec_ctx, decodec, NULL)) < 0) {
         fprintf(stderr, "Failed to use %s decodec open\n", av_get_media_type_string(type));
         return ret;
     }
+    //report what the decoder actually runs with, it may fall back to fewer threads or no threading
+    fprintf(stderr, "%s decoder %s: %d thread(s), %s threading\n", av_get_media_type_string(type),
+            decodec->name, (*codec_ctx)->thread_count, get_thread_type_name((*codec_ctx)->active_thread_type));
     return stream_index;
 }
 
-int demux_and_decode(void *argv) {
+/*
+** video decoder thread: video_queue -> decode_video -> frame_queue
+** exits after the blank packet that demux pushes at end of file has flushed the decoder
+*/
+int decode_video_data(void *argv) {
+    AudioVideoContext *avctx;
+    AVPacket *pkt;
+    AVFrame *frame;
+    int eof = 0;
+
+    if (!argv) {
+        fprintf(stderr, "decode_video_thread's argv is NULL\n");
+        return -1;
+    }
+    avctx = (AudioVideoContext *)argv;
+
+    if (!(pkt = av_packet_alloc())) {
+        fprintf(stderr, "Failed to alloc AVPacket\n");
+        return -1;
+    }
+    //the only frame the decoder thread allocates, decoded data is moved from it into the frame pool
+    if (!(frame = av_frame_alloc())) {
+        fprintf(stderr, "Failed to alloc AVFrame\n");
+        av_packet_free(&pkt);
+        return -1;
+    }
+
+    while (!eof) {
+        if (get_packet_wait(avctx->video_queue, pkt) < 0) {
+            break;
+        }
+        eof = !pkt->data && !pkt->size;
+        //frame队列超过水位时睡眠到渲染循环取走一帧
+        if (wait_thread_signal(&avctx->frame_queue->signal, frame_queue_has_space, avctx->frame_queue) < 0 ||
+            decode_video(avctx, pkt, frame) < 0) {
+            break;
+        }
+        av_packet_unref(pkt);
+    }
+
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    return 0;
+}
+
+static int streams_opened(void *opaque) {
+    AudioVideoContext *avctx = (AudioVideoContext *) opaque;
+    return SDL_AtomicGet(&avctx->streams_ready) != 0;
+}
+
+/*
+** demux thread: only parses the container and fans packets out to
+** audio_queue (consumed by refresh_audio_thread) and video_queue (consumed by decode_video_thread)
+*/
+int demux_packets(void *argv) {
     AudioVideoContext *avctx;
     AVFormatContext *fmt_ctx = NULL;
     AVPacket *pkt = NULL;
-    FILE* file;
+    FILE* file = NULL;
+    SDL_Thread *decode_video_thread = NULL;
+    CodecOptions codec_opts = { CODEC_THREAD_AUTO, 0 };
     int ret;
 
     if (!argv) {
-        fprintf(stderr, "demux_decode_thread's argv is NULL\n");
+        fprintf(stderr, "demux_thread's argv is NULL\n");
         return -1;
     }
 
@@ -274,30 +984,27 @@ int demux_and_decode(void *argv) {
         exit(1);
     }
 
-    if ((avctx->audio_stream_index = init_codec_context(&avctx->acodec_ctx, fmt_ctx, AVMEDIA_TYPE_AUDIO)) < 0) {
+    if ((avctx->audio_stream_index = init_codec_context(&avctx->acodec_ctx, fmt_ctx, AVMEDIA_TYPE_AUDIO, &codec_opts)) < 0) {
         fprintf(stderr, "Failed to init %s decodec context\n", av_get_media_type_string(AVMEDIA_TYPE_AUDIO));
         goto end;
     } else {
         avctx->channels = avctx->acodec_ctx->ch_layout.nb_channels;
         avctx->sample_rate = avctx->acodec_ctx->sample_rate;
+        avctx->audio_time_base = fmt_ctx->streams[avctx->audio_stream_index]->time_base;
+        avctx->audio_bytes_per_sec = avctx->sample_rate * avctx->channels *
+                                     av_get_bytes_per_sample(avctx->acodec_ctx->sample_fmt);
     }
 
-    if ((avctx->video_stream_index = init_codec_context(&avctx->vcodec_ctx, fmt_ctx, AVMEDIA_TYPE_VIDEO)) < 0) {
+    if ((avctx->video_stream_index = init_codec_context(&avctx->vcodec_ctx, fmt_ctx, AVMEDIA_TYPE_VIDEO, &codec_opts)) < 0) {
         fprintf(stderr, "Failed to init %s decodec context\n", av_get_media_type_string(AVMEDIA_TYPE_VIDEO));
         goto end;
     } else {
-        /* allocate image where the decoded image will be put */
+        //decoded frames are uploaded to the texture straight from their planes, no staging image is needed
         avctx->width = avctx->vcodec_ctx->width;
         avctx->height = avctx->vcodec_ctx->height;
         avctx->frame_rate = av_q2d(fmt_ctx->streams[avctx->video_stream_index]->avg_frame_rate);
         avctx->pix_fmt = avctx->vcodec_ctx->pix_fmt;
-        ret = av_image_alloc(avctx->video_dst_data, avctx->video_dst_linesize,
-                                avctx->width, avctx->height, avctx->pix_fmt, 1);
-        if (ret < 0) {
-            fprintf(stderr, "Failed to alloc raw video buffer\n");
-            goto end;
-        }
-        avctx->video_dst_bufsize = ret;
+        avctx->video_time_base = fmt_ctx->streams[avctx->video_stream_index]->time_base;
     }
 
     if (!(file = fopen(avctx->file_name, "rb"))) {
@@ -309,32 +1016,47 @@ int demux_and_decode(void *argv) {
         goto end;
     }
 
-    avctx->delay_mills = 1000 / avctx->frame_rate;
+    //宽高、像素格式和音频参数都已写好，通知主线程创建纹理和刷新线程
+    SDL_AtomicSet(&avctx->streams_ready, 1);
+    wake_thread_signal(&avctx->streams_signal);
+
+    if (!(decode_video_thread = SDL_CreateThread(decode_video_data, "decode_video_thread", avctx))) {
+        fprintf(stderr, "Failed to create decode_video_thread: %s\n", SDL_GetError());
+        goto end;
+    }
 
     while (av_read_frame(fmt_ctx, pkt) >= 0) {
         if (avctx->audio_stream_index == pkt->stream_index) {
             if (pkt->size > 0) {
-                while (avctx->audio_queue->count > 60) {
-                    SDL_Delay(avctx->delay_mills);
+                //队列满时睡眠到音频线程取走packet，成功后pkt的数据归队列所有
+                if (put_packet_wait(avctx->audio_queue, pkt) < 0) {
+                    goto end;
                 }
-                add_node(avctx->audio_queue, pkt);
             }
         } else if (avctx->video_stream_index == pkt->stream_index) {
             if (pkt->size > 0) {
-                while (avctx->frame_queue->count > 25) {
-                    SDL_Delay(avctx->delay_mills);
+                //视频packet交给解码线程，demux线程不再被慢速的视频帧解码阻塞
+                if (put_packet_wait(avctx->video_queue, pkt) < 0) {
+                    goto end;
                 }
-                decode_video(avctx, pkt);
             }
         }
-
-        if (!(pkt = av_packet_alloc())) {
-            fprintf(stderr, "Failed to alloc AVPacket\n");
-            goto end;
-        }
+        av_packet_unref(pkt);
     }
 
+    //空packet通知解码线程文件已结束，解码线程用它flush解码器中剩余的帧
+    av_packet_unref(pkt);
+    put_packet_wait(avctx->video_queue, pkt);
+
 end:
+    //打开失败时也要唤醒主线程，否则它会一直等待
+    if (!SDL_AtomicGet(&avctx->streams_ready)) {
+        SDL_AtomicSet(&avctx->streams_ready, -1);
+        wake_thread_signal(&avctx->streams_signal);
+    }
+    if (decode_video_thread) {
+        SDL_WaitThread(decode_video_thread, NULL);
+    }
     av_packet_free(&pkt);
     if (file) {
         fclose(file);
@@ -346,35 +1068,45 @@ end:
 
 void read_audio_data(void* udata, Uint8* stream, int len) {
     AudioVideoContext *avctx = (AudioVideoContext *) udata;
+    unsigned int remaining, wanted;
+    int stream_len = len;
+
+	SDL_memset(stream, 0, len);
 
-	if (avctx->audio_buffer_len <= 0) {
+	//直接从环形缓冲区读取，不需要加锁，也不需要移动缓冲区中的数据
+	if ((len = audio_ring_mix(avctx->audio_ring, stream, len)) <= 0) {
 		return;
 	}
 
-	SDL_memset(stream, 0, len);
-
-	len = (len < avctx->audio_buffer_len) ? len : avctx->audio_buffer_len;
-	SDL_MixAudio(stream, avctx->audio_position, len, SDL_MIX_MAXVOLUME);
+	SDL_AtomicLock(&avctx->audio_lock);
+	remaining = audio_ring_count(avctx->audio_ring);
+	//声卡现在开始播放本次交出的数据，它的起点是写下标处的pts减去仍在缓冲区中和本次交出的数据时长
+	if (!isnan(avctx->audio_clock)) {
+		avctx->audio_callback_clock = avctx->audio_clock - (double) (remaining + len) / avctx->audio_bytes_per_sec;
+		avctx->audio_callback_period = (double) stream_len / avctx->audio_bytes_per_sec;
+		avctx->audio_callback_time = SDL_GetPerformanceCounter();
+	}
+	SDL_AtomicUnlock(&avctx->audio_lock);
 
-	avctx->audio_position += len;
-	avctx->audio_buffer_len -= len;
+	wanted = (unsigned int) SDL_AtomicGet(&avctx->audio_space_wanted);
+	if (remaining <= BUFFER_REFRESH_SIZE || (wanted && avctx->audio_ring->size - remaining >= wanted)) {
+		wake_thread_signal(&avctx->audio_signal);
+	}
 }
 
 int refresh_audio_data(void *argv) {
     AudioVideoContext *avctx;
+    int ret = 0;
     if (!argv) {
         fprintf(stderr, "refresh_audio_thread's argv is NULL\n");
         return -1;
     }
     avctx = (AudioVideoContext *)argv;
     
-    avctx->audio_buffer = (Uint8*) malloc(BUFFER_SIZE);
-	if (!avctx->audio_buffer) {
-		fprintf(stderr, "Failed to malloc buffer\n");
+    if (!(avctx->audio_ring = alloc_audio_ring(AUDIO_RING_SIZE))) {
+		fprintf(stderr, "Failed to malloc audio ring\n");
 		return -1;
 	}
-    avctx->audio_buffer_len = 0;
-    avctx->audio_position = avctx->audio_buffer;
 
 	SDL_AudioSpec spec;
 	spec.freq = avctx->sample_rate;
@@ -386,53 +1118,56 @@ int refresh_audio_data(void *argv) {
 	
 	if (SDL_OpenAudio(&spec, NULL)) {
 		fprintf(stderr, "Failed to open audio file\n");
-		return -1;
+		ret = -1;
+		goto end;
 	}
 
     // wait decoder thread
-    while (avctx->audio_queue->count < 0) {
-        SDL_Delay(1);
+    if (wait_thread_signal(&avctx->audio_queue->signal, packet_queue_has_data, avctx->audio_queue) < 0) {
+        goto end;
     }
 
 	SDL_PauseAudio(0);
 
     do {
-        //如果音频缓冲区的数据量大于BUFFER_REFRESH_SIZE，则持续等待声卡消费音频数据
-        while (avctx->audio_buffer_len > BUFFER_REFRESH_SIZE) {
-            SDL_Delay(avctx->delay_mills);
+        //如果音频缓冲区的数据量大于BUFFER_REFRESH_SIZE，则睡眠到声卡回调消费音频数据后唤醒
+        if (wait_thread_signal(&avctx->audio_signal, audio_ring_needs_refill, avctx) < 0) {
+            break;
         }
 
         decode_audio(avctx);
         
-    } while(avctx->quit != 1);
+    } while(avctx->quit != 1 && !SDL_AtomicGet(&avctx->audio_signal.abort_request));
 
     //todo: the remaining audio data needs to be played
 
-    if (avctx->audio_buffer) {
-		free(avctx->audio_buffer);
-	}
+end:
+    //the callback reads the ring, stop it before the ring goes away
+    SDL_CloseAudio();
+    free_audio_ring(avctx->audio_ring);
+    avctx->audio_ring = NULL;
 
-    return 0;
+    return ret;
 }
 
 int refresh_video_data(void *argv) {
     AudioVideoContext *avctx;
-    double delay_mills;
     if (!argv) {
         fprintf(stderr, "refresh_video_thread's argv is NULL\n");
         return -1;
     }
     avctx = (AudioVideoContext *)argv;
-    avctx->quit = 0;
 
     while (avctx->quit == 0) {
-        //每隔delay_mills毫秒推送一次刷新事件
+        //推送刷新事件，等渲染循环根据帧的pts和音频时钟算出下一次刷新的时间后再睡眠
         SDL_Event event;
         event.type = REFRESH_EVENT;
         SDL_PushEvent(&event);
-        SDL_Delay(avctx->delay_mills);
+        while (SDL_SemWaitTimeout(avctx->refresh_sem, 100) == SDL_MUTEX_TIMEDOUT && avctx->quit == 0) {
+        }
+        SDL_Delay(SDL_AtomicGet(&avctx->refresh_delay_ms));
     }
-    avctx->quit = 0;
+    //quit stays set, the other threads check it until main has joined them
     //break
     SDL_Event event;
     event.type = BREAK_EVENT;
@@ -442,49 +1177,84 @@ int refresh_video_data(void *argv) {
 
 AudioVideoContext* alloc_audio_video_context() {
     AudioVideoContext *avctx;
-    if (!(avctx = (AudioVideoContext *) malloc(sizeof(AudioVideoContext)))) {
+    if (!(avctx = (AudioVideoContext *) calloc(1, sizeof(AudioVideoContext)))) {
         fprintf(stderr, "Failed to malloc avctx\n");
         return NULL;
     }
 
-    avctx->audio_queue = (AVPacketQueue *) malloc(sizeof(AVPacketQueue));
-    avctx->audio_queue->count = 0;
-    avctx->video_queue = (AVPacketQueue *) malloc(sizeof(AVPacketQueue));
-    avctx->video_queue->count = 0;
+    if (!(avctx->audio_queue = alloc_packet_queue(AUDIO_PACKET_QUEUE_SIZE))) {
+        fprintf(stderr, "Failed to alloc audio packet queue\n");
+        free(avctx);
+        return NULL;
+    }
+    if (!(avctx->video_queue = alloc_packet_queue(VIDEO_PACKET_QUEUE_SIZE))) {
+        fprintf(stderr, "Failed to alloc video packet queue\n");
+        free_packet_queue(avctx->audio_queue);
+        free(avctx);
+        return NULL;
+    }
 
-    avctx->frame_queue = (AVFrameQueue *) malloc(sizeof(AVFrameQueue));
-    avctx->frame_queue->count=0;
-    avctx->frame_queue->head_index = 0;
-    avctx->frame_queue->tail_index = 0;
+    if (!(avctx->frame_queue = alloc_frame_queue())) {
+        fprintf(stderr, "Failed to alloc frame queue\n");
+        exit(1);
+    }
+    if (init_thread_signal(&avctx->audio_signal) < 0) {
+        fprintf(stderr, "Failed to init audio signal\n");
+        exit(1);
+    }
+    if (init_thread_signal(&avctx->streams_signal) < 0) {
+        fprintf(stderr, "Failed to init streams signal\n");
+        exit(1);
+    }
+    if (!(avctx->refresh_sem = SDL_CreateSemaphore(0))) {
+        fprintf(stderr, "Failed to create refresh semaphore: %s\n", SDL_GetError());
+        exit(1);
+    }
 
-    avctx->video_dst_data[0] = (uint8_t *) malloc(sizeof(uint8_t *) * 4);
+    avctx->audio_clock = NAN;
+    avctx->audio_callback_clock = NAN;
+    avctx->framedrop = 1;
 
     return avctx;
 }
 
+//wakes every thread blocked on a queue so that it can see the quit request
+void abort_audio_video_context(AudioVideoContext* avctx) {
+    avctx->quit = 1;
+    abort_thread_signal(&avctx->audio_queue->signal);
+    abort_thread_signal(&avctx->video_queue->signal);
+    abort_thread_signal(&avctx->frame_queue->signal);
+    abort_thread_signal(&avctx->audio_signal);
+    abort_thread_signal(&avctx->streams_signal);
+}
+
 void free_audio_video_context(AudioVideoContext* avctx) {
     if (!avctx) {
         return;
     }
 
-    free(avctx->audio_queue);
-    free(avctx->video_queue);
+    free_packet_queue(avctx->audio_queue);
+    free_packet_queue(avctx->video_queue);
 
-    free(avctx->video_dst_data[0]);
-    //free(avctx->video_dst_linesize[0]);
+    free_frame_queue(avctx->frame_queue);
+    SDL_DestroySemaphore(avctx->refresh_sem);
+    destroy_thread_signal(&avctx->audio_signal);
+    destroy_thread_signal(&avctx->streams_signal);
 
     free(avctx);
 }
 
 int main(int argc, char *argv[]) {
-    AudioVideoContext *avctx;
-    SDL_Window *window;
-    SDL_Renderer *renderer;
-    SDL_Texture *texture;
-    SDL_Rect rect;
+    AudioVideoContext *avctx = NULL;
+    SDL_Window *window = NULL;
+    SDL_Renderer *renderer = NULL;
+    SDL_Texture *texture = NULL;
+    SDL_Rect rect, video_rect;
     SDL_Event event;
-    SDL_Thread *demux_decode_thread, *refresh_video_thread, *refresh_audio_thread;
-    char *buffer;
+    AVFrame *frame;
+    SDL_Thread *demux_thread = NULL, *refresh_video_thread = NULL, *refresh_audio_thread = NULL;
+    double refresh_delay;
+    Uint32 status_ticks = 0;
     int ret;
 
     /*
@@ -512,13 +1282,6 @@ int main(int argc, char *argv[]) {
         goto end;
     }
 
-    //videos in yuv420p format need to use SDL_PIXELFORMAT_IYUV as the texture format
-    if (!(texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_IYUV, 
-        SDL_TEXTUREACCESS_STREAMING, WINDOW_DEFAULT_WIDTH, WINDOW_DEFAULT_HEIGHT))) {
-        fprintf(stderr, "Failed to create texture\n");
-        goto end;
-    }
-
     if (!(avctx = alloc_audio_video_context())) {
         fprintf(stderr, "Failed to alloc audio video context\n");
         goto end;
@@ -526,12 +1289,16 @@ int main(int argc, char *argv[]) {
     avctx->file_name = "D:\\Server\\c_code\\build\\source.mp4";//argv[1];
     SDL_Delay(100);
 
-    if (!(demux_decode_thread = SDL_CreateThread(demux_and_decode, "demux_decode_thread", avctx))) {
-        fprintf(stderr, "Failed to create demux_decode_thread: %s\n", SDL_GetError());
+    if (!(demux_thread = SDL_CreateThread(demux_packets, "demux_thread", avctx))) {
+        fprintf(stderr, "Failed to create demux_thread: %s\n", SDL_GetError());
+        goto end;
+    }
+    //纹理大小和音频参数由demux线程打开解码器后得到，等它打开完成而不是猜测一个固定的时间
+    if (wait_thread_signal(&avctx->streams_signal, streams_opened, avctx) < 0 ||
+        SDL_AtomicGet(&avctx->streams_ready) < 0) {
+        fprintf(stderr, "Failed to open the streams of %s\n", avctx->file_name);
         goto end;
     }
-    //
-    SDL_Delay(500);
     
     if (!(refresh_video_thread = SDL_CreateThread(refresh_video_data, "refresh_video_thread", avctx))) {
         fprintf(stderr, "Failed to create refresh_video_thread: %s\n", SDL_GetError());
@@ -543,29 +1310,42 @@ int main(int argc, char *argv[]) {
         goto end;
     }
 
-    buffer = (char *) malloc(avctx->width * avctx->height * 3 / 2);
+    //videos in yuv420p format need to use SDL_PIXELFORMAT_IYUV as the texture format
+    //the texture has the size of the video so that frames can be uploaded without scaling or copying
+    if (!(texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_IYUV, 
+        SDL_TEXTUREACCESS_STREAMING, avctx->width, avctx->height))) {
+        fprintf(stderr, "Failed to create texture\n");
+        goto end;
+    }
+    if (avctx->pix_fmt != AV_PIX_FMT_YUV420P && avctx->pix_fmt != AV_PIX_FMT_YUVJ420P) {
+        fprintf(stderr, "Warning: pixel format %s can not be displayed as IYUV, frames are skipped\n",
+                av_get_pix_fmt_name(avctx->pix_fmt));
+    }
 
     while (1) {
         //等待SDL事件进入
         SDL_WaitEvent(&event);
         //收到刷新事件对页面进行刷新
         if (event.type == REFRESH_EVENT) {
-            //这里是读取一帧视频真，数据格式是YUV420P，像素排列是4:2:0，一行像素=width*height+width*1/4+height*1/4 = width*height*3/2
-            //所以下面这句话刚好就是读取了一个视频帧YUV的数据长度
+            //数据格式是YUV420P，Y U V三个平面直接从AVFrame上传到纹理，每个平面按各自的linesize读取，
+            //linesize可能大于宽度(解码器的对齐填充)，所以不需要先拷贝成紧凑的width*height*3/2缓冲区
             //fprintf(stderr, "the size is %d\n", avctx->frame_queue->count);
-            if (avctx->frame_queue->count > 0) {
-                AVFrame *frame = avctx->frame_queue->frame_array[avctx->frame_queue->head_index];
-
-                av_image_copy(avctx->video_dst_data, avctx->video_dst_linesize,
-                    (const uint8_t **)(frame->data), frame->linesize,
-                    avctx->pix_fmt, avctx->width, avctx->height);
-
-                memcpy(buffer, avctx->video_dst_data[0], avctx->video_dst_bufsize);
-                avctx->frame_queue->count--;
-                avctx->frame_queue->head_index  = (avctx->frame_queue->head_index + 1) % 30;
-                av_frame_free(&frame);
+            //按音频时钟选出这次要显示的帧，迟到的帧被丢弃，未到时间则重复显示上一帧
+            if ((frame = sync_video_frame(avctx, &refresh_delay))) {
+                if (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P) {
+                    //only the part of the texture covered by this frame is updated
+                    video_rect.x = 0;
+                    video_rect.y = 0;
+                    video_rect.w = FFMIN(frame->width, avctx->width);
+                    video_rect.h = FFMIN(frame->height, avctx->height);
+                    SDL_UpdateYUVTexture(texture, &video_rect,
+                        frame->data[0], frame->linesize[0],
+                        frame->data[1], frame->linesize[1],
+                        frame->data[2], frame->linesize[2]);
+                }
+                //纹理上传完成后才归还帧池中的槽位，解码线程才能复用这帧的数据
+                pop_frame(avctx->frame_queue);
 
-                SDL_UpdateTexture(texture, NULL, buffer, avctx->width);
                 rect.x = 0;
                 rect.y = 0;
                 rect.w = WINDOW_DEFAULT_WIDTH;
@@ -574,17 +1354,42 @@ int main(int argc, char *argv[]) {
                 SDL_RenderClear(renderer);
                 SDL_RenderCopy(renderer, texture, NULL, &rect);
                 SDL_RenderPresent(renderer);
+                avctx->frames_displayed++;
+            }
+
+            //通知refresh_video_thread下一次刷新前需要等待的时间
+            SDL_AtomicSet(&avctx->refresh_delay_ms, (int) (FFMIN(refresh_delay, REFRESH_DELAY_MAX) * 1000 + 0.5));
+            SDL_SemPost(avctx->refresh_sem);
+
+            //每秒输出一次同步状态: 音频时钟、音视频差值、显示/丢弃/重复的帧数
+            if (SDL_GetTicks() - status_ticks >= 1000) {
+                status_ticks = SDL_GetTicks();
+                fprintf(stderr, "%7.2f A-V:%7.3f displayed=%u dropped=%u repeated=%u decoder_dropped=%d skip=%d\r",
+                        get_audio_clock(avctx), avctx->av_diff,
+                        avctx->frames_displayed, avctx->frames_dropped, avctx->frames_repeated,
+                        SDL_AtomicGet(&avctx->decoder_frames_dropped), SDL_AtomicGet(&avctx->decoder_skip_level));
             }
-            
         } else if (event.type == SDL_QUIT) {//点击右上角的叉号退出线程
-            avctx->quit = 1;
+            abort_audio_video_context(avctx);
         } else if (event.type == BREAK_EVENT) {//退出标志
             break;
         }
     }
 
 end:
-
+    //先让所有线程退出，再释放它们使用的队列和信号
+    if (avctx) {
+        abort_audio_video_context(avctx);
+    }
+    if (demux_thread) {
+        SDL_WaitThread(demux_thread, NULL);
+    }
+    if (refresh_video_thread) {
+        SDL_WaitThread(refresh_video_thread, NULL);
+    }
+    if (refresh_audio_thread) {
+        SDL_WaitThread(refresh_audio_thread, NULL);
+    }
     free_audio_video_context(avctx);
 
     if (texture) {